@@ -0,0 +1,44 @@
+/* memory_ops.c - memory.h behind plain functions, for replay.c
+ *
+ * memory.h replaces malloc and friends with static functions of its own,
+ * so it lives in this translation unit, away from the libc ones.
+*/
+
+#include <stddef.h>
+
+#define HEAP_SIZE 0
+#define MEMORY_MMAP
+#include "../memory.h"
+
+void *memory_h_malloc(size_t size)
+{
+    return size > 0x7fffffff ? NULL : malloc(size ? (int)size : 1);
+}
+
+void *memory_h_calloc(size_t count, size_t size)
+{
+    if(count == 0 || size == 0) return memory_h_malloc(0);
+    if(count > 0x7fffffff / size) return NULL;
+
+    return calloc((int)count, (int)size);
+}
+
+void *memory_h_realloc(void *ptr, size_t size)
+{
+    return size > 0x7fffffff ? NULL : realloc(ptr, size ? (int)size : 1);
+}
+
+void memory_h_free(void *ptr)
+{
+    free(ptr);
+}
+
+void memory_h_usage(long long *heap_size, long long *in_use)
+{
+    struct memory_stats stats;
+
+    memstats(&stats);
+
+    *heap_size = stats.heap_size;
+    *in_use = stats.in_use;
+}
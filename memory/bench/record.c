@@ -0,0 +1,301 @@
+/* record.c - records the allocations of a program into a trace file
+ *
+ * Build it as a shared library and preload it into the program to trace:
+ *
+ *     gcc -O2 -shared -fPIC -o record.so memory/bench/record.c
+ *     MEMORY_TRACE=out.trace LD_PRELOAD=./record.so ./program
+ *
+ * malloc, calloc, realloc and free are recorded; other allocation
+ * functions pass through, and frees of pointers the recorder never
+ * saw are dropped. Needs glibc, for the __libc_* entry points.
+*/
+
+#define _GNU_SOURCE
+#include "trace.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+#define BUFFER_RECORDS 4096
+
+/*-------------------------------------------------------------------*/
+/*                              Globals                              */
+/*-------------------------------------------------------------------*/
+
+static int TRACE_FD = -1;
+static volatile int TRACE_LOCK = 0;
+static __thread int RECORDING = 0; /* set while the recorder itself runs */
+
+static unsigned char BUFFER[BUFFER_RECORDS * TRACE_RECORD_SIZE];
+static int BUFFERED = 0;
+
+static uint64_t START_TIME = 0;
+static uint32_t NEXT_ID = 1;
+
+/* open addressing table from live pointers to their ids, kept in
+ * mmap'd memory so it never goes through the allocator being traced */
+static uintptr_t *TABLE_KEYS = NULL;
+static uint32_t *TABLE_IDS = NULL;
+static size_t TABLE_SIZE = 0, TABLE_USED = 0;
+
+#define TOMBSTONE ((uintptr_t)1)
+
+/*------------------------------------------------------------------------------------*/
+/*                              Function Implementations                              */
+/*------------------------------------------------------------------------------------*/
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void flush_buffer(void)
+{
+    unsigned char *data = BUFFER;
+    size_t left = (size_t)BUFFERED * TRACE_RECORD_SIZE;
+
+    while(left > 0)
+    {
+        ssize_t written = write(TRACE_FD, data, left);
+
+        if(written <= 0) break;
+
+        data += written;
+        left -= (size_t)written;
+    }
+
+    BUFFERED = 0;
+}
+
+static size_t slot_of(uintptr_t key)
+{
+    uint64_t hash = (uint64_t)key * 0x9e3779b97f4a7c15ull;
+
+    return (size_t)(hash >> 20) & (TABLE_SIZE - 1);
+}
+
+static void table_insert(uintptr_t key, uint32_t id);
+
+static int table_grow(void)
+{
+    uintptr_t *old_keys = TABLE_KEYS;
+    uint32_t *old_ids = TABLE_IDS;
+    size_t old_size = TABLE_SIZE, live = 0, size, i;
+    void *keys, *ids;
+
+    for(i = 0; i < old_size; i++)
+        if(old_keys[i] > TOMBSTONE) live++;
+
+    /* a table full of tombstones only needs rehashing, not doubling */
+    size = old_size == 0 ? 1 << 16 : live * 4 < old_size ? old_size : old_size * 2;
+
+    keys = mmap(NULL, size * sizeof(uintptr_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(keys == MAP_FAILED) return 0;
+
+    ids = mmap(NULL, size * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ids == MAP_FAILED)
+    {
+        munmap(keys, size * sizeof(uintptr_t));
+        return 0;
+    }
+
+    TABLE_KEYS = (uintptr_t *)keys;
+    TABLE_IDS = (uint32_t *)ids;
+    TABLE_SIZE = size;
+    TABLE_USED = 0;
+
+    for(i = 0; i < old_size; i++)
+        if(old_keys[i] > TOMBSTONE) table_insert(old_keys[i], old_ids[i]);
+
+    if(old_size)
+    {
+        munmap(old_keys, old_size * sizeof(uintptr_t));
+        munmap(old_ids, old_size * sizeof(uint32_t));
+    }
+
+    return 1;
+}
+
+static void table_insert(uintptr_t key, uint32_t id)
+{
+    if((TABLE_USED + 1) * 2 > TABLE_SIZE && !table_grow()) return;
+
+    size_t slot = slot_of(key);
+
+    while(TABLE_KEYS[slot] > TOMBSTONE) slot = (slot + 1) & (TABLE_SIZE - 1);
+
+    if(TABLE_KEYS[slot] == 0) TABLE_USED++;
+
+    TABLE_KEYS[slot] = key;
+    TABLE_IDS[slot] = id;
+}
+
+/* returns the id of a live pointer and forgets it, or 0 */
+static uint32_t table_remove(uintptr_t key)
+{
+    if(TABLE_SIZE == 0) return 0;
+
+    size_t slot = slot_of(key);
+
+    while(TABLE_KEYS[slot] != 0)
+    {
+        if(TABLE_KEYS[slot] == key)
+        {
+            TABLE_KEYS[slot] = TOMBSTONE;
+            return TABLE_IDS[slot];
+        }
+
+        slot = (slot + 1) & (TABLE_SIZE - 1);
+    }
+
+    return 0;
+}
+
+static int begin_record(void)
+{
+    if(RECORDING || TRACE_FD < 0) return 0;
+
+    RECORDING = 1;
+
+    while(__atomic_exchange_n(&TRACE_LOCK, 1, __ATOMIC_ACQUIRE));
+
+    return 1;
+}
+
+static void end_record(void)
+{
+    __atomic_store_n(&TRACE_LOCK, 0, __ATOMIC_RELEASE);
+
+    RECORDING = 0;
+}
+
+static void emit(uint8_t op, uint32_t id, size_t size)
+{
+    struct trace_record record;
+
+    record.op = op;
+    record.id = id;
+    record.size = size > 0xffffffffu ? 0xffffffffu : (uint32_t)size;
+    record.time = now() - START_TIME;
+
+    trace_pack(BUFFER + BUFFERED * TRACE_RECORD_SIZE, &record);
+
+    if(++BUFFERED == BUFFER_RECORDS) flush_buffer();
+}
+
+static void record_allocation(uint8_t op, void *ptr, size_t size)
+{
+    if(ptr == NULL || !begin_record()) return;
+
+    uint32_t id = NEXT_ID++;
+
+    table_insert((uintptr_t)ptr, id);
+    emit(op, id, size);
+
+    end_record();
+}
+
+__attribute__((constructor))
+static void start_trace(void)
+{
+    const char *path = getenv("MEMORY_TRACE");
+
+    if(path == NULL) return;
+
+    RECORDING = 1;
+
+    TRACE_FD = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(TRACE_FD >= 0 && write(TRACE_FD, TRACE_MAGIC, 8) != 8)
+    {
+        close(TRACE_FD);
+        TRACE_FD = -1;
+    }
+
+    START_TIME = now();
+    RECORDING = 0;
+}
+
+__attribute__((destructor))
+static void stop_trace(void)
+{
+    if(TRACE_FD < 0 || !begin_record()) return;
+
+    flush_buffer();
+    close(TRACE_FD);
+
+    TRACE_FD = -1;
+
+    end_record();
+}
+
+void *malloc(size_t size)
+{
+    void *ptr = __libc_malloc(size);
+
+    record_allocation(TRACE_MALLOC, ptr, size);
+
+    return ptr;
+}
+
+void *calloc(size_t count, size_t size)
+{
+    void *ptr = __libc_calloc(count, size);
+
+    record_allocation(TRACE_CALLOC, ptr, count * size);
+
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if(ptr == NULL) return malloc(size);
+
+    /* glibc frees the block and returns NULL, so that is a free */
+    if(size == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+
+    void *new_ptr = __libc_realloc(ptr, size);
+
+    /* a failed realloc leaves the old block alive */
+    if(new_ptr == NULL || !begin_record()) return new_ptr;
+
+    uint32_t id = table_remove((uintptr_t)ptr);
+
+    if(id == 0) id = NEXT_ID++;
+
+    table_insert((uintptr_t)new_ptr, id);
+    emit(TRACE_REALLOC, id, size);
+
+    end_record();
+
+    return new_ptr;
+}
+
+void free(void *ptr)
+{
+    if(ptr != NULL && begin_record())
+    {
+        uint32_t id = table_remove((uintptr_t)ptr);
+
+        if(id != 0) emit(TRACE_FREE, id, 0);
+
+        end_record();
+    }
+
+    __libc_free(ptr);
+}
@@ -0,0 +1,277 @@
+/* replay.c - replays an allocation trace against memory.h and libc malloc
+ *
+ *     gcc -O2 -fno-builtin -c memory/bench/memory_ops.c -o memory_ops.o
+ *     gcc -O2 memory/bench/replay.c memory_ops.o -o replay
+ *     ./replay out.trace
+ *
+ * Each allocator replays the trace twice: once untimed for throughput,
+ * and once timing every operation for the latency percentiles. During the
+ * timed pass, heap size and use are also sampled from the allocators'
+ * own statistics, outside the timed window. The unused share of the
+ * heap at peak use, 1 - in use / heap size, is worked out the same way
+ * for both, since libc has no figure for its largest free chunk.
+*/
+
+#include "trace.h"
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SAMPLE_INTERVAL 1024
+
+/*---------------------------------------------------------------------------*/
+/*                              Data Structures                              */
+/*---------------------------------------------------------------------------*/
+
+struct allocator
+{
+    const char *name;
+    void *(*malloc)(size_t);
+    void *(*calloc)(size_t, size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+    void (*usage)(long long *, long long *);
+};
+
+struct result
+{
+    double seconds;
+    long long failures, peak_heap, peak_requested, peak_in_use;
+    double unused; /* share of the heap not in use, at the peak in use sample */
+    uint32_t *latencies;
+};
+
+/*---------------------------------------------------------------------------------*/
+/*                              Function Declarations                              */
+/*---------------------------------------------------------------------------------*/
+
+void *memory_h_malloc(size_t size);
+void *memory_h_calloc(size_t count, size_t size);
+void *memory_h_realloc(void *ptr, size_t size);
+void memory_h_free(void *ptr);
+void memory_h_usage(long long *heap_size, long long *in_use);
+
+/*------------------------------------------------------------------------------------*/
+/*                              Function Implementations                              */
+/*------------------------------------------------------------------------------------*/
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void libc_usage(long long *heap_size, long long *in_use)
+{
+    struct mallinfo2 info = mallinfo2();
+
+    *heap_size = (long long)(info.arena + info.hblkhd);
+    *in_use = (long long)(info.uordblks + info.hblkhd);
+}
+
+static struct trace_record *load_trace(const char *path, size_t *count)
+{
+    FILE *file = fopen(path, "rb");
+    char magic[8];
+
+    if(file == NULL) return NULL;
+
+    if(fread(magic, 1, 8, file) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0)
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    size_t capacity = 1 << 16, used = 0;
+    struct trace_record *records = (struct trace_record *)malloc(capacity * sizeof(struct trace_record));
+    unsigned char packed[TRACE_RECORD_SIZE];
+
+    while(records != NULL && fread(packed, 1, TRACE_RECORD_SIZE, file) == TRACE_RECORD_SIZE)
+    {
+        if(used == capacity)
+        {
+            capacity *= 2;
+            records = (struct trace_record *)realloc(records, capacity * sizeof(struct trace_record));
+
+            if(records == NULL) break;
+        }
+
+        trace_unpack(packed, &records[used++]);
+    }
+
+    fclose(file);
+
+    *count = used;
+
+    return records;
+}
+
+static void replay(const struct allocator *allocator, const struct trace_record *records, size_t count,
+                   uint32_t max_id, int timed, struct result *result)
+{
+    void **slots = (void **)calloc((size_t)max_id + 1, sizeof(void *));
+    size_t *sizes = (size_t *)calloc((size_t)max_id + 1, sizeof(size_t));
+    long long requested = 0;
+    size_t i;
+
+    result->failures = result->peak_heap = result->peak_requested = result->peak_in_use = 0;
+    result->unused = 0.0;
+
+    uint64_t start = now();
+
+    for(i = 0; i < count; i++)
+    {
+        const struct trace_record *record = &records[i];
+        void **slot = &slots[record->id];
+        uint64_t before = timed ? now() : 0;
+        void *ptr;
+
+        switch(record->op)
+        {
+            case TRACE_MALLOC:
+            case TRACE_CALLOC:
+            {
+                if(*slot != NULL) break;
+
+                ptr = record->op == TRACE_MALLOC ? allocator->malloc(record->size) : allocator->calloc(1, record->size);
+
+                if(ptr == NULL) { result->failures++; break; }
+
+                *(unsigned char *)ptr = 1;
+                *slot = ptr;
+
+                requested += record->size;
+                sizes[record->id] = record->size;
+
+                break;
+            }
+            case TRACE_REALLOC:
+            {
+                ptr = allocator->realloc(*slot, record->size);
+
+                if(ptr == NULL) { result->failures++; break; }
+
+                *(unsigned char *)ptr = 1;
+                *slot = ptr;
+
+                requested += (long long)record->size - (long long)sizes[record->id];
+                sizes[record->id] = record->size;
+
+                break;
+            }
+            case TRACE_FREE:
+            {
+                allocator->free(*slot);
+                *slot = NULL;
+
+                requested -= (long long)sizes[record->id];
+                sizes[record->id] = 0;
+
+                break;
+            }
+        }
+
+        if(!timed) continue;
+
+        result->latencies[i] = (uint32_t)(now() - before);
+
+        /* sampling stays out of the timed window, and out of the throughput pass */
+        if(requested > result->peak_requested || i % SAMPLE_INTERVAL == 0)
+        {
+            long long heap_size, in_use;
+
+            allocator->usage(&heap_size, &in_use);
+
+            if(heap_size > result->peak_heap) result->peak_heap = heap_size;
+
+            if(in_use > result->peak_in_use)
+            {
+                result->peak_in_use = in_use;
+                result->unused = 1.0 - (double)in_use / heap_size;
+            }
+        }
+
+        if(requested > result->peak_requested) result->peak_requested = requested;
+    }
+
+    result->seconds = (double)(now() - start) / 1e9;
+
+    for(i = 0; i <= max_id; i++) allocator->free(slots[i]);
+
+    free(slots);
+    free(sizes);
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void report(const struct allocator *allocator, const struct trace_record *records, size_t count, uint32_t max_id)
+{
+    struct result throughput, timing;
+
+    timing.latencies = (uint32_t *)malloc(count * sizeof(uint32_t));
+
+    if(timing.latencies == NULL) return;
+
+    replay(allocator, records, count, max_id, 0, &throughput);
+    replay(allocator, records, count, max_id, 1, &timing);
+
+    qsort(timing.latencies, count, sizeof(uint32_t), compare_latencies);
+
+    printf("%-8s %12.0f ops/s  p50 %5u ns  p99 %6u ns  p99.9 %7u ns  max %9u ns\n", allocator->name,
+           count / throughput.seconds, timing.latencies[count / 2], timing.latencies[count * 99 / 100],
+           timing.latencies[count * 999 / 1000], timing.latencies[count - 1]);
+    printf("%-8s peak heap %lld bytes for %lld requested (%.2fx), unused %.3f, %lld failed\n\n",
+           "", timing.peak_heap, timing.peak_requested,
+           timing.peak_requested ? (double)timing.peak_heap / timing.peak_requested : 0.0,
+           timing.unused, timing.failures);
+
+    free(timing.latencies);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct allocator allocators[] =
+    {
+        { "memory.h", memory_h_malloc, memory_h_calloc, memory_h_realloc, memory_h_free, memory_h_usage },
+        { "libc", malloc, calloc, realloc, free, libc_usage }
+    };
+
+    size_t count, i;
+
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s trace\n", argv[0]);
+        return 1;
+    }
+
+    struct trace_record *records = load_trace(argv[1], &count);
+
+    if(records == NULL || count == 0)
+    {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        return 1;
+    }
+
+    uint32_t max_id = 0;
+
+    for(i = 0; i < count; i++)
+        if(records[i].id > max_id) max_id = records[i].id;
+
+    printf("%zu operations, %u blocks, %.3f s recorded\n\n", count, max_id, records[count - 1].time / 1e9);
+
+    for(i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+        report(&allocators[i], records, count, max_id);
+
+    free(records);
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+/* trace.h - allocation trace format shared by the recorder and the replayer
+ *
+ * Copyright (c) 2021 Cleanware
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* a trace file is the 8 byte magic followed by packed little endian
+ * records of TRACE_RECORD_SIZE bytes each */
+#define TRACE_MAGIC "MEMTRC01"
+#define TRACE_RECORD_SIZE 17
+
+/*---------------------------------------------------------------------------*/
+/*                              Data Structures                              */
+/*---------------------------------------------------------------------------*/
+
+enum trace_op
+{
+    TRACE_MALLOC,  /* 0 */
+    TRACE_CALLOC,  /* 1 */
+    TRACE_REALLOC, /* 2 */
+    TRACE_FREE     /* 3 */
+};
+
+/* pointers are replaced by ids, numbered from 1 in order of allocation;
+ * a realloc keeps the id of the block it resizes */
+struct trace_record
+{
+    uint8_t op;
+    uint32_t id, size;
+    uint64_t time; /* nanoseconds since the first record */
+};
+
+/*---------------------------------------------------------------------------------*/
+/*                              Function Declarations                              */
+/*---------------------------------------------------------------------------------*/
+
+/**
+ * Packs a record into TRACE_RECORD_SIZE bytes.
+*/
+static void trace_pack(unsigned char *out, const struct trace_record *record);
+
+/**
+ * Unpacks a record from TRACE_RECORD_SIZE bytes.
+*/
+static void trace_unpack(const unsigned char *in, struct trace_record *record);
+
+/*------------------------------------------------------------------------------------*/
+/*                              Function Implementations                              */
+/*------------------------------------------------------------------------------------*/
+
+static void trace_pack(unsigned char *out, const struct trace_record *record)
+{
+    int i;
+
+    out[0] = record->op;
+
+    for(i = 0; i < 4; i++) out[1 + i] = (unsigned char)(record->id >> (8 * i));
+    for(i = 0; i < 4; i++) out[5 + i] = (unsigned char)(record->size >> (8 * i));
+    for(i = 0; i < 8; i++) out[9 + i] = (unsigned char)(record->time >> (8 * i));
+}
+
+static void trace_unpack(const unsigned char *in, struct trace_record *record)
+{
+    int i;
+
+    record->op = in[0];
+    record->id = record->size = 0;
+    record->time = 0;
+
+    for(i = 0; i < 4; i++) record->id |= (uint32_t)in[1 + i] << (8 * i);
+    for(i = 0; i < 4; i++) record->size |= (uint32_t)in[5 + i] << (8 * i);
+    for(i = 0; i < 8; i++) record->time |= (uint64_t)in[9 + i] << (8 * i);
+}
+
+#endif
@@ -22,213 +22,2486 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+/* MEMORY_MMAP needs MAP_ANONYMOUS and madvise(), which are outside ISO C
+ * and strict POSIX, so -std=c99 and the like hide them; they are asked
+ * for here, which only works when no system header came first. Otherwise
+ * build with _DEFAULT_SOURCE (or _GNU_SOURCE, _BSD_SOURCE) defined */
+#if defined(MEMORY_MMAP) && !defined(_DEFAULT_SOURCE)
+	#define _DEFAULT_SOURCE
+#endif
+
+#include <stdint.h>
+
 #ifndef HEAP_SIZE
-	#define HEAP_SIZE (1024 * 1024) /* 1 MB */
+	#define HEAP_SIZE (1024 * 1024) /* 1 MB, 0 to rely on heap_init() or MEMORY_MMAP */
+#endif
+
+#ifndef MEMORY_MAX_REGIONS
+	#define MEMORY_MAX_REGIONS 64
+#endif
+
+/* define MEMORY_MMAP to map new regions from the OS when the heap runs out,
+ * which also enables heap_snapshot() and heap_restore(); see the top of
+ * the file for the feature macros it needs */
+#ifndef MEMORY_REGION_SIZE
+	#define MEMORY_REGION_SIZE (1024 * 1024) /* smallest mapped region */
+#endif
+
+#ifndef MEMORY_ALIGNMENT
+	#define MEMORY_ALIGNMENT 16 /* must be a power of two */
+#endif
+
+#ifndef MEMORY_CACHE_LINE
+	#define MEMORY_CACHE_LINE 64
+#endif
+
+#ifndef MEMORY_CACHE_SIZE
+	#define MEMORY_CACHE_SIZE 64 /* blocks kept per thread and size class */
+#endif
+
+#ifndef MEMORY_POOL_PAGE
+	#define MEMORY_POOL_PAGE 4096 /* bytes requested from the heap per pool page */
+#endif
+
+#ifndef MEMORY_LOCK_SPINS
+	#define MEMORY_LOCK_SPINS 64 /* pauses on a held heap lock before yielding the CPU */
 #endif
 
 #ifndef NULL
 	#define NULL (void *)0
 #endif
 
+/* define MEMORY_NO_THREADS to drop the heap lock in single threaded programs */
+#if defined(MEMORY_NO_THREADS)
+	#define MEMORY_TLS
+	#define ATOMIC_ADD(target, value) ((*(target) += (value)) - (value))
+	#define ATOMIC_LOAD(target) (*(target))
+	#define LOAD_WORD(target) (*(target))
+	#define STORE_WORD(target, value) (*(target) = (value))
+	#define LOAD_ACQUIRE(target) (*(target))
+	#define STORE_RELEASE(target, value) (*(target) = (value))
+#elif defined(_MSC_VER)
+	#define MEMORY_TLS __declspec(thread)
+	#define ATOMIC_ADD(target, value) _InterlockedExchangeAdd64((target), (value))
+	#define ATOMIC_LOAD(target) (*(target))
+	#define LOAD_WORD(target) (*(volatile unsigned int *)(target))
+	#define STORE_WORD(target, value) (*(volatile unsigned int *)(target) = (value))
+	#define LOAD_ACQUIRE(target) (*(target))
+	#define STORE_RELEASE(target, value) (*(target) = (value))
+	long _InterlockedExchange(long volatile *, long);
+	long _InterlockedCompareExchange(long volatile *, long, long);
+	long long _InterlockedExchangeAdd64(long long volatile *, long long);
+	long long _InterlockedCompareExchange64(long long volatile *, long long, long long);
+	#pragma intrinsic(_InterlockedExchange, _InterlockedCompareExchange, _InterlockedExchangeAdd64, _InterlockedCompareExchange64)
+	void _mm_pause(void);
+	int __stdcall SwitchToThread(void);
+	unsigned long __stdcall FlsAlloc(void (__stdcall *)(void *));
+	int __stdcall FlsSetValue(unsigned long, void *);
+#else
+	#define MEMORY_TLS __thread
+	#define ATOMIC_ADD(target, value) __atomic_fetch_add((target), (value), __ATOMIC_RELAXED)
+	#define ATOMIC_LOAD(target) __atomic_load_n((target), __ATOMIC_RELAXED)
+	#define LOAD_WORD(target) __atomic_load_n((target), __ATOMIC_RELAXED)
+	#define STORE_WORD(target, value) __atomic_store_n((target), (value), __ATOMIC_RELAXED)
+	#define LOAD_ACQUIRE(target) __atomic_load_n((target), __ATOMIC_ACQUIRE)
+	#define STORE_RELEASE(target, value) __atomic_store_n((target), (value), __ATOMIC_RELEASE)
+#endif
+
+/* vector kernels need GCC or Clang vector extensions, since the intrinsic
+ * headers pull in <stdlib.h> and clash with this file's malloc */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && !defined(MEMORY_NO_SIMD)
+	#define MEMORY_X86
+#endif
+
+/* size classes: exact classes in steps of MEMORY_ALIGNMENT up to SMALL_LIMIT
+ * bytes of header and payload, then one class per power of two above it;
+ * free blocks of the small classes sit on per-class lists, larger ones in
+ * a size-ordered tree */
+#define SMALL_LIMIT 512
+#define SMALL_CLASSES (SMALL_LIMIT / MEMORY_ALIGNMENT)
+#define SIZE_CLASSES (SMALL_CLASSES + 22)
+
+#if SMALL_CLASSES > 64
+	#error "MEMORY_ALIGNMENT is too small for the size class bitmap"
+#endif
+
+#if MEMORY_ALIGNMENT < 8
+	#error "MEMORY_ALIGNMENT must be at least the size of a block header"
+#endif
+
+/* POSIX threads flush their caches on exit through a thread key */
+#if !defined(MEMORY_NO_THREADS) && !defined(_MSC_VER) && (defined(unix) || defined(__unix__) || defined(__unix) || defined(__APPLE__))
+	#define MEMORY_PTHREADS
+	#include <pthread.h>
+#endif
+
+#define ALIGN_UP(x) (((x) + (MEMORY_ALIGNMENT - 1)) & ~(MEMORY_ALIGNMENT - 1))
+#define HEADER_SIZE ((int)sizeof(struct block))
+
+/* headers sit just below an aligned payload, so a payload size plus
+ * its header is always a multiple of MEMORY_ALIGNMENT */
+#define PAYLOAD_SIZE(x) ((int)ALIGN_UP((x) + HEADER_SIZE) - HEADER_SIZE)
+#define MIN_PAYLOAD PAYLOAD_SIZE((int)sizeof(struct free_links))
+/* the largest request PAYLOAD_SIZE can round up without overflowing */
+#define MAX_REQUEST (0x7fffffff - MEMORY_ALIGNMENT - HEADER_SIZE)
+#define IS_SMALL(size) ((size) + HEADER_SIZE <= SMALL_LIMIT)
+
+#define BLOCK_DATA(b) ((void *)((unsigned char *)(b) + HEADER_SIZE))
+#define DATA_BLOCK(ptr) ((struct block *)((unsigned char *)(ptr) - HEADER_SIZE))
+
+/* the block state lives in the two low bits of the size field; a thread
+ * cache changes the state of its own blocks without the heap lock while
+ * other threads, holding it, read the same word of their neighbours, so
+ * the word is only ever loaded and stored whole, atomically */
+#define BLOCK_SIZE(b) ((int)(LOAD_WORD(&(b)->size) & ~3u))
+#define BLOCK_STATE(b) ((int)(LOAD_WORD(&(b)->size) & 3u))
+#define SET_SIZE(b, s) STORE_WORD(&(b)->size, (unsigned int)(s) | (LOAD_WORD(&(b)->size) & 3u))
+#define SET_STATE(b, state) STORE_WORD(&(b)->size, (LOAD_WORD(&(b)->size) & ~3u) | (unsigned int)(state))
+
+/* physical neighbours, found through the boundary tags */
+#define NEXT_BLOCK(b) ((struct block *)((unsigned char *)BLOCK_DATA(b) + BLOCK_SIZE(b)))
+#define PREV_BLOCK(b) ((struct block *)((unsigned char *)(b) - (b)->prev_size - HEADER_SIZE))
+
+/* block states */
+#define BLOCK_USED 0
+#define BLOCK_FREE 1
+#define BLOCK_CACHED 2 /* held by a thread cache, still used as far as the heap knows */
+#define BLOCK_BATCHED 3 /* about to be released by free_batch() */
+
 /*---------------------------------------------------------------------------*/
 /*                              Data Structures                              */
 /*---------------------------------------------------------------------------*/
 
+/* every block records its own payload size and that of the block
+ * physically before it, so both neighbours are reachable in O(1);
+ * that is the whole per-allocation overhead, 8 bytes */
 struct block
 {
-    int size, free;
-    struct block *next;
+    unsigned int size; /* with the block state packed into the low bits */
+    unsigned int prev_size;
+};
+
+/* stored in the payload of free blocks, so it costs nothing while in use */
+struct free_links
+{
+    struct block *prev, *next;
+};
+
+/* the same for free blocks above SMALL_LIMIT, which form a treap ordered
+ * by size and address, with priorities hashed from the address */
+struct tree_links
+{
+    struct block *left, *right;
+};
+
+#if defined(MEMORY_MMAP) && !(defined(unix) || defined(__unix__) || defined(__unix) || defined(__APPLE__))
+	#undef MEMORY_MMAP
+#endif
+
+#ifdef MEMORY_MMAP
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+
+	#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+		#define MAP_ANONYMOUS MAP_ANON
+	#endif
+#endif
+
+#define SNAPSHOT_MAGIC "MEMHEAP1"
+
+#ifdef MEMORY_X86
+typedef unsigned char vector16 __attribute__((vector_size(16), aligned(1), may_alias));
+typedef unsigned char vector32 __attribute__((vector_size(32), aligned(1), may_alias));
+typedef char mask16 __attribute__((vector_size(16)));
+typedef char mask32 __attribute__((vector_size(32)));
+#endif
+
+/* a contiguous stretch of memory holding blocks between two fences; the
+ * descriptors live outside the regions so unmapping one is always safe */
+/* base, end and REGION_COUNT change under the heap lock but are read
+ * without it by onheap(), so they are published with release stores:
+ * end before base when a region comes in, base first when it goes */
+struct region
+{
+    unsigned char *volatile base, *volatile end; /* end is the closing fence */
+    unsigned char *clean;      /* nothing was handed out from here on, see touch_block() */
+    int size, mapped;
+};
+
+/* a snapshot of the allocator counters, see memstats() */
+struct memory_stats
+{
+    long long in_use, peak;          /* payload bytes handed out */
+    long long heap_size, free_bytes; /* all regions, and what is on the free lists */
+    long long allocations, frees;
+    long long class_allocations[SIZE_CLASSES];
+    long long size_histogram[32];    /* requests of [2^i, 2^(i+1)) bytes */
+    int largest_free;
+    double fragmentation;            /* 1 - largest_free / free_bytes */
+};
+
+/* small blocks a thread freed, kept for its next allocations of the same size */
+struct thread_cache
+{
+    struct block *blocks[SMALL_CLASSES];
+    int counts[SMALL_CLASSES];
+    int registered; /* set once the exit hook will flush it */
+};
+
+/* bump allocator over one region, which is released as a whole */
+struct arena
+{
+    unsigned char *base;
+    int size, used;
+    int owned; /* the region is a heap block that arena_destroy() frees */
+};
+
+/* fixed size objects carved from heap pages, with the free slots
+ * linked through their own first word */
+struct pool
+{
+    int slot_size, page_slots;
+    void *free_slots;
+    unsigned char *next_slot, *page_end; /* uncarved part of the newest page */
+    void *pages;
+    int page_count, used, peak;
+};
+
+struct pool_stats
+{
+    int slot_size, pages, capacity, used, peak;
+};
+
+/* starts a heap snapshot file, padded to a page so the region behind
+ * it maps straight from the file; everything is stored as offsets */
+struct snapshot_header
+{
+    char magic[8];
+    long long offset, size; /* of the region data, from its opening fence */
+    long long root;         /* of the root pointer, from the opening fence */
+    int alignment, header_size;
 };
 
 /*---------------------------------------------------------------------------------*/
 /*                              Function Declarations                              */
 /*---------------------------------------------------------------------------------*/
 
+static void lock_backoff(int *spins);
+static void heap_lock(void);
+static void heap_unlock(void);
+static struct region *region_of(void *ptr);
+static struct region *unused_region(void);
+static struct region *add_region(void *buffer, int size, int mapped, int zeroed);
+static void heap_setup(void);
+static int grow_heap(int size);
+static void release_region(struct block *block);
+static int size_class(int size);
+static void insert_free(struct block *block);
+static void remove_free(struct block *block);
+static struct block *tree_insert(struct block *root, struct block *block);
+static struct block *tree_remove(struct block *root, struct block *block);
+static struct block *find_free(int size);
 static void split(struct block *, int);
-static void merge(void);
+static struct block *merge(struct block *block);
+static unsigned char *touch_block(struct block *block);
+static struct block *take_block(int size, unsigned char **clean);
+static struct block *take_aligned_block(int alignment, int size);
+static void release_block(struct block *block);
+static void trim_block(struct block *block, int size);
+static int resize_block(struct block *block, int size);
+static void raise_peak(long long in_use);
+static void count_allocation(int requested, int size);
+static void count_free(int size);
+static int release_cache(void);
+static void cache_exit(void *cache);
+static void register_cache(void);
+static void refill_cache(int index, int size);
+static void drain_cache(int index, int keep);
 static void *malloc(int size);
 static void *realloc(void *ptr, int size);
 static void free(void *ptr);
 static int memsize(void *ptr);
+static void copy_forward_words(unsigned char *dest, const unsigned char *src, int size);
+static void copy_backward_words(unsigned char *dest, const unsigned char *src, int size);
+static void set_words(unsigned char *dest, int value, int size);
+static int compare_words(const unsigned char *a, const unsigned char *b, int size);
+static int find_words(const unsigned char *ptr, int value, int size);
+static void select_kernels(void);
 static void *memcpy(void *dest, void *src, int size);
 static void *memmove(void *dest, void *src, int size);
+static void *memset(void *dest, int value, int size);
+static int memcmp(void *a, void *b, int size);
+static void *memchr(void *ptr, int value, int size);
+
+/**
+ * Allocates zeroed memory for count objects of the specified size.
+ * Memory fresh from the OS or the static HEAP is known to be zero
+ * and is not cleared again.
+*/
+static void *calloc(int count, int size);
+
 static int onheap(void *ptr);
 static int memuse(void);
 
+/**
+ * Adds the specified buffer to the heap. When called before the
+ * first allocation, the static HEAP is not used at all.
+ * Returns 1 on success.
+*/
+static int heap_init(void *buffer, int size);
+
+/**
+ * Fills in the allocator statistics. The counters are kept
+ * up to date on every call, so this is cheap enough to poll.
+*/
+static void memstats(struct memory_stats *stats);
+
+/**
+ * Allocates memory whose address is a multiple of the specified
+ * alignment, which must be a power of two. realloc() keeps the
+ * alignment only while it can resize in place.
+*/
+static void *aligned_malloc(int alignment, int size);
+
+/**
+ * Frees memory allocated by aligned_malloc() or cacheline_malloc().
+*/
+static void aligned_free(void *ptr);
+
+/**
+ * Allocates memory that starts on a cache line and is padded to a
+ * whole number of lines, so it shares no line with other blocks.
+*/
+static void *cacheline_malloc(int size);
+
+/**
+ * Allocates count blocks of the specified size at once and stores them
+ * in ptrs. They are carved from one free block when the heap has one big
+ * enough, so they also end up next to each other. Returns the number of
+ * blocks allocated, which is only less than count when memory runs out.
+*/
+static int malloc_batch(int count, int size, void **ptrs);
+
+/**
+ * Frees count blocks under a single lock, merging neighbours among
+ * them into one free block each. NULL entries are skipped.
+*/
+static void free_batch(void **ptrs, int count);
+
+/**
+ * Returns the blocks cached by the calling thread to the shared heap.
+ * Threads do this on exit by themselves where the platform has a hook
+ * for it, POSIX threads and Windows; elsewhere call it before a thread
+ * exits.
+*/
+static void flush_thread_cache(void);
+
+/**
+ * Creates an arena with the specified capacity
+ * in a single block taken from the heap.
+*/
+static struct arena *arena_create(int size);
+
+/**
+ * Creates an arena inside a caller provided buffer.
+ * The arena itself is stored at the start of the buffer.
+*/
+static struct arena *arena_wrap(void *buffer, int size);
+
+/**
+ * Allocates aligned memory from an arena, or returns
+ * NULL when the arena is exhausted.
+*/
+static void *arena_alloc(struct arena *arena, int size);
+
+/**
+ * Returns the current position of an arena, to be
+ * passed to arena_reset() later.
+*/
+static int arena_mark(struct arena *arena);
+
+/**
+ * Releases everything allocated from an arena since
+ * the specified mark (0 releases everything).
+*/
+static void arena_reset(struct arena *arena, int mark);
+
+/**
+ * Destroys an arena, returning its block to the heap
+ * if it was made by arena_create().
+*/
+static void arena_destroy(struct arena *arena);
+
+/**
+ * Creates a pool handing out objects of the specified size.
+*/
+static struct pool *pool_create(int object_size);
+
+/**
+ * Allocates one object from a pool.
+*/
+static void *pool_alloc(struct pool *pool);
+
+/**
+ * Returns an object to the pool it was allocated from.
+*/
+static void pool_free(struct pool *pool, void *ptr);
+
+/**
+ * Fills in the occupancy statistics of a pool.
+*/
+static void pool_stats(struct pool *pool, struct pool_stats *stats);
+
+/**
+ * Destroys a pool and every object allocated from it.
+*/
+static void pool_destroy(struct pool *pool);
+
+#ifdef MEMORY_MMAP
+static int write_file(int fd, const void *data, long long size);
+static struct region *restore_region(unsigned char *memory, long long size, unsigned char *root);
+
+/**
+ * Writes the heap region holding root to a file, so that a later
+ * process can map it back with heap_restore(). Blocks link to their
+ * neighbours through sizes, so the region works at any address; data
+ * kept in it should do the same and point through offsets from root.
+ * Returns 1 on success.
+*/
+static int heap_snapshot(const char *path, void *root);
+
+/**
+ * Maps a snapshot written by heap_snapshot() into the heap with a single
+ * copy-on-write mmap() and returns its root pointer, or NULL on failure,
+ * which includes a root that does not lie in a used block.
+ * Like heap_init(), a restore before the first allocation keeps the
+ * static HEAP out of use.
+*/
+static void *heap_restore(const char *path);
+#endif
+
 /*-------------------------------------------------------------------*/
 /*                              Globals                              */
 /*-------------------------------------------------------------------*/
 
+#if HEAP_SIZE > 0
 static unsigned char HEAP[HEAP_SIZE];
-static struct block *FREE_BLOCKS = (struct block *)HEAP;
+#endif
+
+static struct region REGIONS[MEMORY_MAX_REGIONS];
+static volatile int REGION_COUNT = 0;
+static int MAPPED_REGIONS = 0;
+
+/* HEAP_BYTES and FREE_BYTES change under the heap lock, the rest atomically */
+static long long HEAP_BYTES = 0, FREE_BYTES = 0;
+static volatile long long IN_USE = 0, PEAK_USE = 0, ALLOCATIONS = 0, FREES = 0;
+static volatile long long CLASS_ALLOCATIONS[SIZE_CLASSES];
+static volatile long long SIZE_HISTOGRAM[32];
+
+/* one list per small class, plus a bitmap of the non-empty ones */
+static struct block *FREE_BLOCKS[SMALL_CLASSES];
+static unsigned long long FREE_CLASSES = 0;
+static struct block *FREE_TREE = NULL;
+
+static volatile long HEAP_LOCK = 0;
+
+/* copy kernels picked for the running CPU by select_kernels(), which
+ * moves KERNELS_READY from 0 to 1 while it picks and to 2 once done */
+static volatile long KERNELS_READY = 0;
+static void (*COPY_FORWARD)(unsigned char *, const unsigned char *, int) = NULL;
+static void (*COPY_BACKWARD)(unsigned char *, const unsigned char *, int) = NULL;
+static void (*SET_MEMORY)(unsigned char *, int, int) = NULL;
+static int (*COMPARE_MEMORY)(const unsigned char *, const unsigned char *, int) = NULL;
+static int (*FIND_MEMORY)(const unsigned char *, int, int) = NULL;
+static struct region *LAST_TOUCHED = NULL;
+static MEMORY_TLS struct thread_cache THREAD_CACHE;
+
+/* runs flush_thread_cache() in every thread that exits with a cache */
+#if defined(MEMORY_PTHREADS)
+static pthread_key_t CACHE_KEY;
+#elif defined(_MSC_VER) && !defined(MEMORY_NO_THREADS)
+static unsigned long CACHE_KEY;
+#endif
+static int CACHE_KEY_READY = 0;
 
 /*------------------------------------------------------------------------------------*/
 /*                              Function Implementations                              */
 /*------------------------------------------------------------------------------------*/
 
-static void split(struct block *block, int size)
+static int lowest_bit(unsigned long long bits)
 {
-    struct block *new_block = (struct block *)(block + size + sizeof(struct block));
-
-    new_block->size = block->size - size - sizeof(struct block);
-    new_block->free = 1;
-    new_block->next = block->next;
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(bits);
+#else
+    int i = 0;
+    while(!(bits & 1)) { bits >>= 1; i++; }
 
-    block->size = size;
-    block->free = 0;
-    block->next = new_block;
+    return i;
+#endif
 }
 
-static void merge(void)
+static int highest_bit(unsigned int bits)
 {
-    if(FREE_BLOCKS->size == 0) return;
+#if defined(__GNUC__) || defined(__clang__)
+    return 31 - __builtin_clz(bits);
+#else
+    int i = 0;
+    while(bits >>= 1) i++;
 
-    struct block *current = FREE_BLOCKS;
+    return i;
+#endif
+}
 
-    while(current && current->next)
+/* called while the heap lock is held elsewhere: pauses for a while,
+ * since the holder is usually about done, then gives up the CPU in case
+ * the holder was preempted and waits for it */
+static void lock_backoff(int *spins)
+{
+    if(++*spins < MEMORY_LOCK_SPINS)
     {
-        if(current->free && current->next->free)
-        {
-            current->size += current->next->size + sizeof(struct block);
-            current->next = current->next->next;
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+        _mm_pause();
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_ia32_pause();
+#endif
+        return;
+    }
 
-            continue;
-        }
+    *spins = 0;
 
-        current = current->next;
-    }
+#if defined(_MSC_VER)
+    SwitchToThread();
+#elif defined(unix) || defined(__unix__) || defined(__unix) || defined(__APPLE__)
+    sched_yield();
+#endif
 }
 
-static void *malloc(int size)
+static void heap_lock(void)
 {
-    struct block *current = FREE_BLOCKS;
+#if defined(MEMORY_NO_THREADS)
+#elif defined(_MSC_VER)
+    int spins = 0;
 
-    if(FREE_BLOCKS->size == 0)
-    {
-        FREE_BLOCKS->size = HEAP_SIZE - sizeof(struct block);
-        FREE_BLOCKS->free = 1;
-        FREE_BLOCKS->next = NULL;
-    }
+    while(_InterlockedExchange(&HEAP_LOCK, 1))
+        while(HEAP_LOCK) lock_backoff(&spins);
+#else
+    int spins = 0;
 
-    TOTAL_ALLOCATIONS += size;
+    while(__atomic_exchange_n(&HEAP_LOCK, 1, __ATOMIC_ACQUIRE))
+        while(__atomic_load_n(&HEAP_LOCK, __ATOMIC_RELAXED)) lock_backoff(&spins);
+#endif
+}
 
-    while(current != NULL)
-    {
-        if(current->free)
-        {
-            if(current->size == size)
-            {
-                current->free = 0;
-                current++;
+static void heap_unlock(void)
+{
+#if defined(MEMORY_NO_THREADS)
+#elif defined(_MSC_VER)
+    _InterlockedExchange(&HEAP_LOCK, 0);
+#else
+    __atomic_store_n(&HEAP_LOCK, 0, __ATOMIC_RELEASE);
+#endif
+}
 
-                return (void *)current;
-            }
-            else if(current->size > size + sizeof(struct block))
-            {
-                split(current, size);
-                current++;
+/* the heap lock must be held for everything touching REGIONS */
+static struct region *region_of(void *ptr)
+{
+    unsigned char *address = (unsigned char *)ptr;
+    int i;
 
-                return (void *)current;
-            }
-        }
+    for(i = 0; i < REGION_COUNT; i++)
+        if(REGIONS[i].base <= address && address < REGIONS[i].end) return &REGIONS[i];
 
-        current = current->next;
-    }
+    return NULL;
+}
+
+static struct region *unused_region(void)
+{
+    int i;
+
+    for(i = 0; i < MEMORY_MAX_REGIONS; i++)
+        if(REGIONS[i].base == NULL) return &REGIONS[i];
 
     return NULL;
 }
 
-static void *realloc(void *ptr, int size)
+static struct region *add_region(void *buffer, int size, int mapped, int zeroed)
 {
-    if(onheap(ptr))
-    {
-        void *new_ptr = malloc(size);
+    uintptr_t start = ALIGN_UP((uintptr_t)buffer);
+    uintptr_t end = ((uintptr_t)buffer + size) & ~(uintptr_t)(MEMORY_ALIGNMENT - 1);
 
-        if(new_ptr)
-        {
-            memcpy(new_ptr, ptr, size);
+    if(buffer == NULL || size <= 0 || end < start + 3 * HEADER_SIZE + MIN_PAYLOAD + MEMORY_ALIGNMENT) return NULL;
 
-            free(ptr);
+    struct region *region = unused_region();
 
-            return new_ptr;
-        }
-        else return NULL;
-    }
-    else return NULL;
+    if(region == NULL) return NULL;
+
+    struct block *fence, *first, *last;
+
+    /* zero sized, permanently used fences at both ends stop merge() from
+     * walking off the region; the opening one is aligned so the first
+     * payload after it is too */
+    fence = (struct block *)start;
+    SET_SIZE(fence, 0);
+    SET_STATE(fence, BLOCK_USED);
+    fence->prev_size = 0;
+
+    first = NEXT_BLOCK(fence);
+    SET_SIZE(first, (int)((end - start - 2 * HEADER_SIZE) & ~(uintptr_t)(MEMORY_ALIGNMENT - 1)) - HEADER_SIZE);
+    SET_STATE(first, BLOCK_FREE);
+    first->prev_size = 0;
+
+    last = NEXT_BLOCK(first);
+    SET_SIZE(last, 0);
+    SET_STATE(last, BLOCK_USED);
+    last->prev_size = BLOCK_SIZE(first);
+
+    insert_free(first);
+
+    region->size = size;
+    region->mapped = mapped;
+    /* only the fences and the links of the first block were written to a
+     * zeroed buffer; anything else could hold the caller's data */
+    region->clean = zeroed ? (unsigned char *)BLOCK_DATA(first) + MIN_PAYLOAD : (unsigned char *)last;
+
+    STORE_RELEASE(&region->end, (unsigned char *)last);
+    STORE_RELEASE(&region->base, (unsigned char *)buffer);
+
+    if(region - REGIONS >= REGION_COUNT) STORE_RELEASE(&REGION_COUNT, (int)(region - REGIONS) + 1);
+    if(mapped) MAPPED_REGIONS++;
+
+    HEAP_BYTES += size;
+
+    return region;
 }
 
-static void free(void *ptr)
+static void heap_setup(void)
 {
-    if(onheap(ptr))
-    {
-        struct block *current = ptr;
-        current--;
+#if HEAP_SIZE > 0
+    add_region(HEAP, HEAP_SIZE, 0, 1);
+#endif
+}
 
-        current->free = 1;
+/* maps a region big enough for a block of the specified size,
+ * growing geometrically so the region table lasts */
+static int grow_heap(int size)
+{
+#ifdef MEMORY_MMAP
+    long page = sysconf(_SC_PAGESIZE);
+    long bytes = (long)MEMORY_REGION_SIZE << (MAPPED_REGIONS / 2 < 10 ? MAPPED_REGIONS / 2 : 10);
+    long needed = (long)size + 4 * HEADER_SIZE + MEMORY_ALIGNMENT;
+
+    if(bytes < needed) bytes = needed;
+
+    bytes = (bytes + page - 1) / page * page;
+
+    if(bytes > 0x7fffffff) return 0;
 
-        merge();
+    void *memory = mmap(NULL, (size_t)bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(memory == MAP_FAILED) return 0;
+
+    if(add_region(memory, (int)bytes, 1, 1) == NULL)
+    {
+        munmap(memory, (size_t)bytes);
+        return 0;
     }
+
+    return 1;
+#else
+    (void)size;
+    return 0;
+#endif
 }
 
-static int memsize(void *ptr)
+/* called with a free block that was just merged; if it fills a mapped
+ * region the region goes back to the OS, except for the last one, which
+ * only has its pages dropped so the next growth is cheap */
+static void release_region(struct block *block)
 {
-    if(onheap(ptr))
+#ifdef MEMORY_MMAP
+    if(BLOCK_SIZE(PREV_BLOCK(block)) != 0 || BLOCK_SIZE(NEXT_BLOCK(block)) != 0) return;
+
+    struct region *region = region_of(block);
+
+    if(region == NULL || !region->mapped) return;
+
+    if(MAPPED_REGIONS > 1)
+    {
+        unsigned char *base = region->base;
+
+        remove_free(block);
+
+        STORE_RELEASE(&region->base, (unsigned char *)NULL);
+        STORE_RELEASE(&region->end, (unsigned char *)NULL);
+
+        munmap(base, (size_t)region->size);
+
+        HEAP_BYTES -= region->size;
+        MAPPED_REGIONS--;
+    }
+    else
     {
-        struct block *current = ptr;
-        current--;
+        long page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = ((uintptr_t)BLOCK_DATA(block) + MIN_PAYLOAD + page - 1) & ~(uintptr_t)(page - 1);
+        uintptr_t end = (uintptr_t)NEXT_BLOCK(block) & ~(uintptr_t)(page - 1);
 
-        return current->size;
+#ifdef MADV_DONTNEED
+        if(end > start) madvise((void *)start, (size_t)(end - start), MADV_DONTNEED);
+#else
+        (void)start;
+        (void)end;
+#endif
     }
-    else return -1;
+#else
+    (void)block;
+#endif
 }
 
-static void *memcpy(void *dest, void *src, int size)
+static int size_class(int size)
 {
-    char *b_dest = (char *)dest;
-    char *b_src = (char *)src;
+    size += HEADER_SIZE;
 
-    int i;
-    for(i = 0; i < size; i++) b_dest[i] = b_src[i];
+    if(size <= SMALL_LIMIT) return size / MEMORY_ALIGNMENT - 1;
 
-    return dest;
+    return SMALL_CLASSES + highest_bit((unsigned int)size) - highest_bit(SMALL_LIMIT);
 }
 
-static void *memmove(void *dest, void *src, int size)
+#define LEFT(b) (((struct tree_links *)BLOCK_DATA(b))->left)
+#define RIGHT(b) (((struct tree_links *)BLOCK_DATA(b))->right)
+
+/* free blocks sit at regular strides, which a single multiply maps to
+ * correlated priorities and a deep tree, so the address goes through
+ * the full 64-bit finalizer of MurmurHash3 */
+static unsigned int tree_priority(struct block *block)
 {
-    char *b_dest = (char *)dest;
-    char *b_src = (char *)src;
+    unsigned long long x = (unsigned long long)(uintptr_t)block;
 
-    char *temp = (char *)malloc(sizeof(char) * size);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
 
-    if(temp == NULL) return NULL;
+    return (unsigned int)x;
+}
 
-    int i;
+static int tree_before(struct block *a, struct block *b)
+{
+    return BLOCK_SIZE(a) < BLOCK_SIZE(b) || (BLOCK_SIZE(a) == BLOCK_SIZE(b) && a < b);
+}
 
-    for(i = 0; i < size; i++) temp[i] = b_src[i];
-    for(i = 0; i < size; i++) b_dest[i] = temp[i];
+static struct block *tree_insert(struct block *root, struct block *block)
+{
+    struct block *child;
 
-    return dest;
+    if(root == NULL) return block;
+
+    if(tree_before(block, root))
+    {
+        child = LEFT(root) = tree_insert(LEFT(root), block);
+
+        if(tree_priority(child) > tree_priority(root))
+        {
+            LEFT(root) = RIGHT(child);
+            RIGHT(child) = root;
+            root = child;
+        }
+    }
+    else
+    {
+        child = RIGHT(root) = tree_insert(RIGHT(root), block);
+
+        if(tree_priority(child) > tree_priority(root))
+        {
+            RIGHT(root) = LEFT(child);
+            LEFT(child) = root;
+            root = child;
+        }
+    }
+
+    return root;
 }
 
-static int onheap(void *ptr)
+static struct block *tree_remove(struct block *root, struct block *block)
 {
-    return ((void *)HEAP) <= ptr && ptr <= (((void *)HEAP) + HEAP_SIZE);
+    if(root == NULL) return NULL;
+
+    if(root == block)
+    {
+        struct block *left = LEFT(root), *right = RIGHT(root);
+
+        if(left == NULL) return right;
+        if(right == NULL) return left;
+
+        /* rotate the higher priority child up and keep sinking the block */
+        if(tree_priority(left) > tree_priority(right))
+        {
+            LEFT(root) = RIGHT(left);
+            RIGHT(left) = tree_remove(root, block);
+
+            return left;
+        }
+
+        RIGHT(root) = LEFT(right);
+        LEFT(right) = tree_remove(root, block);
+
+        return right;
+    }
+
+    if(tree_before(block, root)) LEFT(root) = tree_remove(LEFT(root), block);
+    else RIGHT(root) = tree_remove(RIGHT(root), block);
+
+    return root;
 }
 
-static int memuse(void)
+static void insert_free(struct block *block)
 {
-    if(FREE_BLOCKS->size == 0) return 0;
+    FREE_BYTES += BLOCK_SIZE(block);
 
-    struct block *current = FREE_BLOCKS;
-    int result = 0;
-
-    while(current != NULL)
+    if(!IS_SMALL(BLOCK_SIZE(block)))
     {
-        if(!current->free) result += current->size;
-        current = current->next;
+        LEFT(block) = RIGHT(block) = NULL;
+        FREE_TREE = tree_insert(FREE_TREE, block);
+
+        return;
     }
 
-    return result;
+    int index = size_class(BLOCK_SIZE(block));
+    struct free_links *links = BLOCK_DATA(block);
+
+    links->prev = NULL;
+    links->next = FREE_BLOCKS[index];
+
+    if(FREE_BLOCKS[index]) ((struct free_links *)BLOCK_DATA(FREE_BLOCKS[index]))->prev = block;
+
+    FREE_BLOCKS[index] = block;
+    FREE_CLASSES |= 1ULL << index;
 }
 
+static void remove_free(struct block *block)
+{
+    FREE_BYTES -= BLOCK_SIZE(block);
+
+    if(!IS_SMALL(BLOCK_SIZE(block)))
+    {
+        FREE_TREE = tree_remove(FREE_TREE, block);
+        return;
+    }
+
+    int index = size_class(BLOCK_SIZE(block));
+    struct free_links *links = BLOCK_DATA(block);
+
+    if(links->prev) ((struct free_links *)BLOCK_DATA(links->prev))->next = links->next;
+    else FREE_BLOCKS[index] = links->next;
+
+    if(links->next) ((struct free_links *)BLOCK_DATA(links->next))->prev = links->prev;
+
+    if(FREE_BLOCKS[index] == NULL) FREE_CLASSES &= ~(1ULL << index);
+}
+
+/* small sizes take the first block of the smallest fitting class, anything
+ * else the best fit from the tree, the smallest block that is big enough */
+static struct block *find_free(int size)
+{
+    if(IS_SMALL(size))
+    {
+        unsigned long long candidates = FREE_CLASSES & (~0ULL << size_class(size));
+
+        if(candidates) return FREE_BLOCKS[lowest_bit(candidates)];
+    }
+
+    struct block *current = FREE_TREE, *best = NULL;
+
+    while(current != NULL)
+    {
+        if(BLOCK_SIZE(current) >= size)
+        {
+            best = current;
+            current = LEFT(current);
+        }
+        else current = RIGHT(current);
+    }
+
+    return best;
+}
+
+static void split(struct block *block, int size)
+{
+    struct block *new_block = (struct block *)((unsigned char *)BLOCK_DATA(block) + size);
+
+    SET_SIZE(new_block, BLOCK_SIZE(block) - size - HEADER_SIZE);
+    SET_STATE(new_block, BLOCK_FREE);
+    new_block->prev_size = size;
+
+    NEXT_BLOCK(new_block)->prev_size = BLOCK_SIZE(new_block);
+
+    SET_SIZE(block, size);
+
+    insert_free(new_block);
+}
+
+/* joins a block that is not on a free list with its free physical
+ * neighbours and returns the resulting block */
+static struct block *merge(struct block *block)
+{
+    struct block *next = NEXT_BLOCK(block);
+
+    if(BLOCK_STATE(next) == BLOCK_FREE)
+    {
+        remove_free(next);
+        SET_SIZE(block, BLOCK_SIZE(block) + BLOCK_SIZE(next) + HEADER_SIZE);
+    }
+
+    if(BLOCK_STATE(PREV_BLOCK(block)) == BLOCK_FREE)
+    {
+        struct block *prev = PREV_BLOCK(block);
+
+        remove_free(prev);
+        SET_SIZE(prev, BLOCK_SIZE(prev) + BLOCK_SIZE(block) + HEADER_SIZE);
+        block = prev;
+    }
+
+    NEXT_BLOCK(block)->prev_size = BLOCK_SIZE(block);
+
+    return block;
+}
+
+/* moves the clean mark of a block's region past the block, and past the
+ * header and links of whatever free block follows it; bytes from the mark
+ * on are still zero in zeroed regions, which calloc() relies on, so every
+ * block has to pass through here before it is handed out. Returns the
+ * old mark */
+static unsigned char *touch_block(struct block *block)
+{
+    unsigned char *address = (unsigned char *)block;
+    struct region *region = LAST_TOUCHED;
+
+    if(region == NULL || address < region->base || address >= region->end)
+    {
+        region = region_of(block);
+
+        if(region == NULL) return address;
+
+        LAST_TOUCHED = region;
+    }
+
+    unsigned char *clean = region->clean;
+    unsigned char *mark = (unsigned char *)BLOCK_DATA(NEXT_BLOCK(block)) + MIN_PAYLOAD;
+
+    if(mark > region->end) mark = region->end;
+    if(mark > clean) region->clean = mark;
+
+    return clean;
+}
+
+/* the heap lock must be held for take_block() and release_block();
+ * clean, when given, receives the region's clean mark from before */
+static struct block *take_block(int size, unsigned char **clean)
+{
+    if(REGION_COUNT == 0) heap_setup();
+
+    struct block *current = find_free(size);
+
+    if(current == NULL && grow_heap(size)) current = find_free(size);
+    if(current == NULL) return NULL;
+
+    remove_free(current);
+    SET_STATE(current, BLOCK_USED);
+
+    if(BLOCK_SIZE(current) >= size + HEADER_SIZE + MIN_PAYLOAD) split(current, size);
+
+    unsigned char *mark = touch_block(current);
+
+    if(clean != NULL) *clean = mark;
+
+    return current;
+}
+
+/* finds a block with room for an aligned payload, hands the unaligned
+ * front back to the heap as a free block and trims the tail */
+static struct block *take_aligned_block(int alignment, int size)
+{
+    if(REGION_COUNT == 0) heap_setup();
+
+    int search = size + alignment + HEADER_SIZE + MIN_PAYLOAD;
+    struct block *current = find_free(search);
+
+    if(current == NULL && grow_heap(search)) current = find_free(search);
+    if(current == NULL) return NULL;
+
+    remove_free(current);
+    SET_STATE(current, BLOCK_USED);
+
+    uintptr_t data = (uintptr_t)BLOCK_DATA(current);
+    uintptr_t aligned = (data + alignment - 1) & ~(uintptr_t)(alignment - 1);
+
+    if(aligned != data)
+    {
+        /* the front has to be big enough to stand as a block of its own */
+        while(aligned - data < (uintptr_t)(HEADER_SIZE + MIN_PAYLOAD)) aligned += alignment;
+
+        struct block *front = current;
+        int gap = (int)(aligned - data);
+
+        current = DATA_BLOCK(aligned);
+        SET_SIZE(current, BLOCK_SIZE(front) - gap);
+        SET_STATE(current, BLOCK_USED);
+        current->prev_size = gap - HEADER_SIZE;
+
+        NEXT_BLOCK(current)->prev_size = BLOCK_SIZE(current);
+
+        SET_SIZE(front, gap - HEADER_SIZE);
+        SET_STATE(front, BLOCK_FREE);
+
+        insert_free(front);
+    }
+
+    trim_block(current, size);
+    touch_block(current);
+
+    return current;
+}
+
+static void release_block(struct block *block)
+{
+    block = merge(block);
+    SET_STATE(block, BLOCK_FREE);
+
+    insert_free(block);
+    release_region(block);
+}
+
+/* gives the tail of a used block back to the heap */
+static void trim_block(struct block *block, int size)
+{
+    if(BLOCK_SIZE(block) < size + HEADER_SIZE + MIN_PAYLOAD) return;
+
+    split(block, size);
+
+    struct block *rest = NEXT_BLOCK(block);
+
+    remove_free(rest);
+    release_block(rest);
+}
+
+/* resizes a used block without moving it, growing into the next block
+ * when that one is free; returns 0 if the block has to move instead */
+static int resize_block(struct block *block, int size)
+{
+    if(BLOCK_SIZE(block) < size)
+    {
+        struct block *next = NEXT_BLOCK(block);
+
+        if(BLOCK_STATE(next) != BLOCK_FREE || BLOCK_SIZE(block) + HEADER_SIZE + BLOCK_SIZE(next) < size) return 0;
+
+        remove_free(next);
+
+        SET_SIZE(block, BLOCK_SIZE(block) + HEADER_SIZE + BLOCK_SIZE(next));
+        NEXT_BLOCK(block)->prev_size = BLOCK_SIZE(block);
+
+        trim_block(block, size);
+        touch_block(block);
+
+        return 1;
+    }
+
+    trim_block(block, size);
+
+    return 1;
+}
+
+/* raises the high-water mark to in_use, if that is above it */
+static void raise_peak(long long in_use)
+{
+    long long peak = ATOMIC_LOAD(&PEAK_USE);
+
+    while(in_use > peak)
+    {
+#if defined(MEMORY_NO_THREADS)
+        PEAK_USE = in_use;
+        break;
+#elif defined(_MSC_VER)
+        long long seen = _InterlockedCompareExchange64(&PEAK_USE, in_use, peak);
+
+        if(seen == peak) break;
+        peak = seen;
+#else
+        if(__atomic_compare_exchange_n(&PEAK_USE, &peak, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+#endif
+    }
+}
+
+static void count_allocation(int requested, int size)
+{
+    raise_peak(ATOMIC_ADD(&IN_USE, size) + size);
+
+    ATOMIC_ADD(&ALLOCATIONS, 1);
+    ATOMIC_ADD(&CLASS_ALLOCATIONS[size_class(size)], 1);
+    ATOMIC_ADD(&SIZE_HISTOGRAM[highest_bit((unsigned int)requested)], 1);
+}
+
+static void count_free(int size)
+{
+    ATOMIC_ADD(&IN_USE, -(long long)size);
+    ATOMIC_ADD(&FREES, 1);
+}
+
+#if defined(_MSC_VER) && !defined(MEMORY_NO_THREADS)
+static void __stdcall cache_exit(void *cache)
+#else
+static void cache_exit(void *cache)
+#endif
+{
+    (void)cache;
+
+    /* a later destructor may free into the cache again, which
+     * registers it again and gets it flushed once more */
+    THREAD_CACHE.registered = 0;
+    flush_thread_cache();
+}
+
+/* called the first time a thread puts a block in its cache */
+static void register_cache(void)
+{
+    THREAD_CACHE.registered = 1;
+
+#if defined(MEMORY_PTHREADS) || (defined(_MSC_VER) && !defined(MEMORY_NO_THREADS))
+    heap_lock();
+
+    if(!CACHE_KEY_READY)
+    {
+#if defined(MEMORY_PTHREADS)
+        CACHE_KEY_READY = pthread_key_create(&CACHE_KEY, cache_exit) == 0 ? 1 : -1;
+#else
+        CACHE_KEY = FlsAlloc(cache_exit);
+        CACHE_KEY_READY = CACHE_KEY != 0xffffffffUL ? 1 : -1;
+#endif
+    }
+
+    heap_unlock();
+
+#if defined(MEMORY_PTHREADS)
+    if(CACHE_KEY_READY == 1) pthread_setspecific(CACHE_KEY, &THREAD_CACHE);
+#else
+    if(CACHE_KEY_READY == 1) FlsSetValue(CACHE_KEY, &THREAD_CACHE);
+#endif
+#else
+    (void)CACHE_KEY_READY;
+#endif
+}
+
+/* moves half a cache's worth of blocks of one small class from the heap
+ * into the calling thread's cache, under a single lock */
+static void refill_cache(int index, int size)
+{
+    struct thread_cache *cache = &THREAD_CACHE;
+    int i;
+
+    if(!cache->registered) register_cache();
+
+    heap_lock();
+
+    for(i = 0; i < MEMORY_CACHE_SIZE / 2 + 1; i++)
+    {
+        struct block *block = take_block(size, NULL);
+
+        if(block == NULL) break;
+
+        SET_STATE(block, BLOCK_CACHED);
+        *(struct block **)BLOCK_DATA(block) = cache->blocks[index];
+
+        cache->blocks[index] = block;
+        cache->counts[index]++;
+    }
+
+    heap_unlock();
+}
+
+static void drain_cache(int index, int keep)
+{
+    struct thread_cache *cache = &THREAD_CACHE;
+
+    heap_lock();
+
+    while(cache->counts[index] > keep)
+    {
+        struct block *block = cache->blocks[index];
+
+        cache->blocks[index] = *(struct block **)BLOCK_DATA(block);
+        cache->counts[index]--;
+
+        release_block(block);
+    }
+
+    heap_unlock();
+}
+
+static void *malloc(int size)
+{
+    if(size <= 0 || size > MAX_REQUEST) return NULL;
+
+    int needed = PAYLOAD_SIZE(size);
+    if(needed < MIN_PAYLOAD) needed = MIN_PAYLOAD;
+
+    struct block *current;
+
+    if(IS_SMALL(needed))
+    {
+        struct thread_cache *cache = &THREAD_CACHE;
+        int index = size_class(needed);
+
+        if(cache->blocks[index] == NULL) refill_cache(index, needed);
+
+        current = cache->blocks[index];
+
+        if(current != NULL)
+        {
+            cache->blocks[index] = *(struct block **)BLOCK_DATA(current);
+            cache->counts[index]--;
+
+            SET_STATE(current, BLOCK_USED);
+            count_allocation(size, BLOCK_SIZE(current));
+
+            return BLOCK_DATA(current);
+        }
+    }
+
+    heap_lock();
+    current = take_block(needed, NULL);
+    heap_unlock();
+
+    /* the heap may only be short of blocks this thread has cached */
+    if(current == NULL && release_cache() > 0)
+    {
+        heap_lock();
+        current = take_block(needed, NULL);
+        heap_unlock();
+    }
+
+    if(current == NULL) return NULL;
+
+    count_allocation(size, BLOCK_SIZE(current));
+
+    return BLOCK_DATA(current);
+}
+
+static void *calloc(int count, int size)
+{
+    if(count <= 0 || size <= 0 || count > MAX_REQUEST / size) return NULL;
+
+    int total = count * size;
+    int needed = PAYLOAD_SIZE(total);
+    if(needed < MIN_PAYLOAD) needed = MIN_PAYLOAD;
+
+    /* small blocks mostly come recycled from the thread cache */
+    if(IS_SMALL(needed))
+    {
+        void *ptr = malloc(total);
+
+        return ptr == NULL ? NULL : memset(ptr, 0, total);
+    }
+
+    unsigned char *clean;
+
+    heap_lock();
+    struct block *current = take_block(needed, &clean);
+    heap_unlock();
+
+    if(current == NULL && release_cache() > 0)
+    {
+        heap_lock();
+        current = take_block(needed, &clean);
+        heap_unlock();
+    }
+
+    if(current == NULL) return NULL;
+
+    /* only the part below the old clean mark can hold stale data */
+    unsigned char *data = BLOCK_DATA(current);
+
+    if(clean > data) memset(data, 0, clean - data < total ? (int)(clean - data) : total);
+
+    count_allocation(total, BLOCK_SIZE(current));
+
+    return data;
+}
+
+static void *realloc(void *ptr, int size)
+{
+    if(ptr == NULL) return malloc(size);
+
+    if(onheap(ptr))
+    {
+        if(size <= 0 || size > MAX_REQUEST) return NULL;
+
+        struct block *block = DATA_BLOCK(ptr);
+        int needed = PAYLOAD_SIZE(size), old_size = BLOCK_SIZE(block), resized;
+
+        if(needed < MIN_PAYLOAD) needed = MIN_PAYLOAD;
+
+        heap_lock();
+        resized = resize_block(block, needed);
+        heap_unlock();
+
+        if(resized)
+        {
+            long long grown = (long long)BLOCK_SIZE(block) - old_size;
+            long long in_use = ATOMIC_ADD(&IN_USE, grown) + grown;
+
+            if(grown > 0) raise_peak(in_use);
+
+            return ptr;
+        }
+
+        void *new_ptr = malloc(size);
+
+        if(new_ptr)
+        {
+            memcpy(new_ptr, ptr, BLOCK_SIZE(block));
+
+            free(ptr);
+
+            return new_ptr;
+        }
+        else return NULL;
+    }
+    else return NULL;
+}
+
+static void free(void *ptr)
+{
+    if(onheap(ptr))
+    {
+        struct block *current = DATA_BLOCK(ptr);
+
+        if(BLOCK_STATE(current) != BLOCK_USED) return;
+
+        count_free(BLOCK_SIZE(current));
+
+        /* only blocks of an exact small size go into the cache */
+        if(IS_SMALL(BLOCK_SIZE(current)))
+        {
+            struct thread_cache *cache = &THREAD_CACHE;
+            int index = size_class(BLOCK_SIZE(current));
+
+            if(!cache->registered) register_cache();
+
+            SET_STATE(current, BLOCK_CACHED);
+            *(struct block **)BLOCK_DATA(current) = cache->blocks[index];
+
+            cache->blocks[index] = current;
+
+            if(++cache->counts[index] > MEMORY_CACHE_SIZE) drain_cache(index, MEMORY_CACHE_SIZE / 2);
+
+            return;
+        }
+
+        heap_lock();
+        release_block(current);
+        heap_unlock();
+    }
+}
+
+static int memsize(void *ptr)
+{
+    if(onheap(ptr))
+    {
+        struct block *current = DATA_BLOCK(ptr);
+
+        return BLOCK_SIZE(current);
+    }
+    else return -1;
+}
+
+/* both directions copy in ascending (or descending) chunks, loading
+ * each chunk before storing it, so they are safe for overlapping moves
+ * in the matching direction */
+static void copy_forward_words(unsigned char *dest, const unsigned char *src, int size)
+{
+    /* words can only be used when both pointers share an alignment */
+    if((((uintptr_t)dest ^ (uintptr_t)src) & (sizeof(uintptr_t) - 1)) == 0)
+    {
+        while(size > 0 && ((uintptr_t)dest & (sizeof(uintptr_t) - 1)))
+        {
+            *dest++ = *src++;
+            size--;
+        }
+
+        while(size >= (int)sizeof(uintptr_t))
+        {
+            *(uintptr_t *)dest = *(const uintptr_t *)src;
+
+            dest += sizeof(uintptr_t);
+            src += sizeof(uintptr_t);
+            size -= sizeof(uintptr_t);
+        }
+    }
+
+    while(size-- > 0) *dest++ = *src++;
+}
+
+static void copy_backward_words(unsigned char *dest, const unsigned char *src, int size)
+{
+    dest += size;
+    src += size;
+
+    if((((uintptr_t)dest ^ (uintptr_t)src) & (sizeof(uintptr_t) - 1)) == 0)
+    {
+        while(size > 0 && ((uintptr_t)dest & (sizeof(uintptr_t) - 1)))
+        {
+            *--dest = *--src;
+            size--;
+        }
+
+        while(size >= (int)sizeof(uintptr_t))
+        {
+            dest -= sizeof(uintptr_t);
+            src -= sizeof(uintptr_t);
+            size -= sizeof(uintptr_t);
+
+            *(uintptr_t *)dest = *(const uintptr_t *)src;
+        }
+    }
+
+    while(size-- > 0) *--dest = *--src;
+}
+
+/* the word kernels handle the unaligned head bytewise and then go a
+ * machine word at a time */
+static void set_words(unsigned char *dest, int value, int size)
+{
+    uintptr_t fill = (uintptr_t)-1 / 0xff * (unsigned char)value;
+
+    while(size > 0 && ((uintptr_t)dest & (sizeof(uintptr_t) - 1)))
+    {
+        *dest++ = (unsigned char)value;
+        size--;
+    }
+
+    while(size >= (int)sizeof(uintptr_t))
+    {
+        *(uintptr_t *)dest = fill;
+
+        dest += sizeof(uintptr_t);
+        size -= sizeof(uintptr_t);
+    }
+
+    while(size-- > 0) *dest++ = (unsigned char)value;
+}
+
+static int compare_words(const unsigned char *a, const unsigned char *b, int size)
+{
+    if((((uintptr_t)a ^ (uintptr_t)b) & (sizeof(uintptr_t) - 1)) == 0)
+    {
+        while(size > 0 && ((uintptr_t)a & (sizeof(uintptr_t) - 1)))
+        {
+            if(*a != *b) return *a - *b;
+
+            a++;
+            b++;
+            size--;
+        }
+
+        /* the first differing word is settled bytewise below */
+        while(size >= (int)sizeof(uintptr_t) && *(const uintptr_t *)a == *(const uintptr_t *)b)
+        {
+            a += sizeof(uintptr_t);
+            b += sizeof(uintptr_t);
+            size -= sizeof(uintptr_t);
+        }
+    }
+
+    for(; size > 0; a++, b++, size--)
+        if(*a != *b) return *a - *b;
+
+    return 0;
+}
+
+/* returns the offset of the first matching byte or -1; a word has a
+ * match when one of its bytes xor the value is zero */
+static int find_words(const unsigned char *ptr, int value, int size)
+{
+    const uintptr_t ones = (uintptr_t)-1 / 0xff, highs = ones << 7;
+    uintptr_t fill = ones * (unsigned char)value;
+    int offset = 0;
+
+    while(offset < size && ((uintptr_t)(ptr + offset) & (sizeof(uintptr_t) - 1)))
+    {
+        if(ptr[offset] == (unsigned char)value) return offset;
+        offset++;
+    }
+
+    while(size - offset >= (int)sizeof(uintptr_t))
+    {
+        uintptr_t word = *(const uintptr_t *)(ptr + offset) ^ fill;
+
+        if((word - ones) & ~word & highs) break;
+
+        offset += sizeof(uintptr_t);
+    }
+
+    for(; offset < size; offset++)
+        if(ptr[offset] == (unsigned char)value) return offset;
+
+    return -1;
+}
+
+#ifdef MEMORY_X86
+
+__attribute__((target("sse2")))
+static void copy_forward_sse2(unsigned char *dest, const unsigned char *src, int size)
+{
+    while(size >= 64)
+    {
+        vector16 a = *(const vector16 *)src, b = *(const vector16 *)(src + 16);
+        vector16 c = *(const vector16 *)(src + 32), d = *(const vector16 *)(src + 48);
+
+        *(vector16 *)dest = a;
+        *(vector16 *)(dest + 16) = b;
+        *(vector16 *)(dest + 32) = c;
+        *(vector16 *)(dest + 48) = d;
+
+        dest += 64;
+        src += 64;
+        size -= 64;
+    }
+
+    while(size >= 16)
+    {
+        *(vector16 *)dest = *(const vector16 *)src;
+
+        dest += 16;
+        src += 16;
+        size -= 16;
+    }
+
+    while(size-- > 0) *dest++ = *src++;
+}
+
+__attribute__((target("sse2")))
+static void copy_backward_sse2(unsigned char *dest, const unsigned char *src, int size)
+{
+    dest += size;
+    src += size;
+
+    while(size >= 64)
+    {
+        dest -= 64;
+        src -= 64;
+        size -= 64;
+
+        vector16 a = *(const vector16 *)src, b = *(const vector16 *)(src + 16);
+        vector16 c = *(const vector16 *)(src + 32), d = *(const vector16 *)(src + 48);
+
+        *(vector16 *)(dest + 48) = d;
+        *(vector16 *)(dest + 32) = c;
+        *(vector16 *)(dest + 16) = b;
+        *(vector16 *)dest = a;
+    }
+
+    while(size >= 16)
+    {
+        dest -= 16;
+        src -= 16;
+        size -= 16;
+
+        *(vector16 *)dest = *(const vector16 *)src;
+    }
+
+    while(size-- > 0) *--dest = *--src;
+}
+
+__attribute__((target("sse2")))
+static void set_sse2(unsigned char *dest, int value, int size)
+{
+    vector16 fill = (vector16){0} + (unsigned char)value;
+
+    while(size >= 64)
+    {
+        *(vector16 *)dest = fill;
+        *(vector16 *)(dest + 16) = fill;
+        *(vector16 *)(dest + 32) = fill;
+        *(vector16 *)(dest + 48) = fill;
+
+        dest += 64;
+        size -= 64;
+    }
+
+    while(size >= 16)
+    {
+        *(vector16 *)dest = fill;
+
+        dest += 16;
+        size -= 16;
+    }
+
+    while(size-- > 0) *dest++ = (unsigned char)value;
+}
+
+__attribute__((target("sse2")))
+static int compare_sse2(const unsigned char *a, const unsigned char *b, int size)
+{
+    int offset = 0;
+
+    while(size - offset >= 16)
+    {
+        int mask = __builtin_ia32_pmovmskb128((mask16)(*(const vector16 *)(a + offset) == *(const vector16 *)(b + offset)));
+
+        if(mask != 0xffff)
+        {
+            offset += lowest_bit(~mask);
+            return a[offset] - b[offset];
+        }
+
+        offset += 16;
+    }
+
+    for(; offset < size; offset++)
+        if(a[offset] != b[offset]) return a[offset] - b[offset];
+
+    return 0;
+}
+
+__attribute__((target("sse2")))
+static int find_sse2(const unsigned char *ptr, int value, int size)
+{
+    vector16 fill = (vector16){0} + (unsigned char)value;
+    int offset = 0;
+
+    while(size - offset >= 16)
+    {
+        int mask = __builtin_ia32_pmovmskb128((mask16)(*(const vector16 *)(ptr + offset) == fill));
+
+        if(mask) return offset + lowest_bit(mask);
+
+        offset += 16;
+    }
+
+    for(; offset < size; offset++)
+        if(ptr[offset] == (unsigned char)value) return offset;
+
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static void copy_forward_avx2(unsigned char *dest, const unsigned char *src, int size)
+{
+    while(size >= 128)
+    {
+        vector32 a = *(const vector32 *)src, b = *(const vector32 *)(src + 32);
+        vector32 c = *(const vector32 *)(src + 64), d = *(const vector32 *)(src + 96);
+
+        *(vector32 *)dest = a;
+        *(vector32 *)(dest + 32) = b;
+        *(vector32 *)(dest + 64) = c;
+        *(vector32 *)(dest + 96) = d;
+
+        dest += 128;
+        src += 128;
+        size -= 128;
+    }
+
+    while(size >= 32)
+    {
+        *(vector32 *)dest = *(const vector32 *)src;
+
+        dest += 32;
+        src += 32;
+        size -= 32;
+    }
+
+    while(size-- > 0) *dest++ = *src++;
+}
+
+__attribute__((target("avx2")))
+static void copy_backward_avx2(unsigned char *dest, const unsigned char *src, int size)
+{
+    dest += size;
+    src += size;
+
+    while(size >= 128)
+    {
+        dest -= 128;
+        src -= 128;
+        size -= 128;
+
+        vector32 a = *(const vector32 *)src, b = *(const vector32 *)(src + 32);
+        vector32 c = *(const vector32 *)(src + 64), d = *(const vector32 *)(src + 96);
+
+        *(vector32 *)(dest + 96) = d;
+        *(vector32 *)(dest + 64) = c;
+        *(vector32 *)(dest + 32) = b;
+        *(vector32 *)dest = a;
+    }
+
+    while(size >= 32)
+    {
+        dest -= 32;
+        src -= 32;
+        size -= 32;
+
+        *(vector32 *)dest = *(const vector32 *)src;
+    }
+
+    while(size-- > 0) *--dest = *--src;
+}
+
+__attribute__((target("avx2")))
+static void set_avx2(unsigned char *dest, int value, int size)
+{
+    vector32 fill = (vector32){0} + (unsigned char)value;
+
+    while(size >= 128)
+    {
+        *(vector32 *)dest = fill;
+        *(vector32 *)(dest + 32) = fill;
+        *(vector32 *)(dest + 64) = fill;
+        *(vector32 *)(dest + 96) = fill;
+
+        dest += 128;
+        size -= 128;
+    }
+
+    while(size >= 32)
+    {
+        *(vector32 *)dest = fill;
+
+        dest += 32;
+        size -= 32;
+    }
+
+    while(size-- > 0) *dest++ = (unsigned char)value;
+}
+
+__attribute__((target("avx2")))
+static int compare_avx2(const unsigned char *a, const unsigned char *b, int size)
+{
+    int offset = 0;
+
+    while(size - offset >= 32)
+    {
+        unsigned int mask = (unsigned int)__builtin_ia32_pmovmskb256((mask32)(*(const vector32 *)(a + offset) == *(const vector32 *)(b + offset)));
+
+        if(mask != 0xffffffffu)
+        {
+            offset += lowest_bit(~mask);
+            return a[offset] - b[offset];
+        }
+
+        offset += 32;
+    }
+
+    for(; offset < size; offset++)
+        if(a[offset] != b[offset]) return a[offset] - b[offset];
+
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static int find_avx2(const unsigned char *ptr, int value, int size)
+{
+    vector32 fill = (vector32){0} + (unsigned char)value;
+    int offset = 0;
+
+    while(size - offset >= 32)
+    {
+        unsigned int mask = (unsigned int)__builtin_ia32_pmovmskb256((mask32)(*(const vector32 *)(ptr + offset) == fill));
+
+        if(mask) return offset + lowest_bit(mask);
+
+        offset += 32;
+    }
+
+    for(; offset < size; offset++)
+        if(ptr[offset] == (unsigned char)value) return offset;
+
+    return -1;
+}
+
+#endif
+
+/* the first caller picks the kernels, any other waits until it is done */
+static void select_kernels(void)
+{
+#if defined(MEMORY_NO_THREADS)
+    if(KERNELS_READY) return;
+#elif defined(_MSC_VER)
+    int spins = 0;
+
+    if(_InterlockedCompareExchange(&KERNELS_READY, 1, 0) != 0)
+    {
+        while(KERNELS_READY != 2) lock_backoff(&spins);
+        return;
+    }
+#else
+    long expected = 0;
+    int spins = 0;
+
+    if(!__atomic_compare_exchange_n(&KERNELS_READY, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+        while(__atomic_load_n(&KERNELS_READY, __ATOMIC_ACQUIRE) != 2) lock_backoff(&spins);
+        return;
+    }
+#endif
+
+    COPY_FORWARD = copy_forward_words;
+    COPY_BACKWARD = copy_backward_words;
+    SET_MEMORY = set_words;
+    COMPARE_MEMORY = compare_words;
+    FIND_MEMORY = find_words;
+
+#ifdef MEMORY_X86
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2"))
+    {
+        COPY_FORWARD = copy_forward_avx2;
+        COPY_BACKWARD = copy_backward_avx2;
+        SET_MEMORY = set_avx2;
+        COMPARE_MEMORY = compare_avx2;
+        FIND_MEMORY = find_avx2;
+    }
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        COPY_FORWARD = copy_forward_sse2;
+        COPY_BACKWARD = copy_backward_sse2;
+        SET_MEMORY = set_sse2;
+        COMPARE_MEMORY = compare_sse2;
+        FIND_MEMORY = find_sse2;
+    }
+#endif
+
+#if defined(MEMORY_NO_THREADS)
+    KERNELS_READY = 2;
+#elif defined(_MSC_VER)
+    _InterlockedExchange(&KERNELS_READY, 2);
+#else
+    __atomic_store_n(&KERNELS_READY, 2, __ATOMIC_RELEASE);
+#endif
+}
+
+static void *memcpy(void *dest, void *src, int size)
+{
+    if(size <= 0) return dest;
+    if(LOAD_ACQUIRE(&KERNELS_READY) != 2) select_kernels();
+
+    COPY_FORWARD((unsigned char *)dest, (const unsigned char *)src, size);
+
+    return dest;
+}
+
+static void *memmove(void *dest, void *src, int size)
+{
+    unsigned char *b_dest = (unsigned char *)dest;
+    const unsigned char *b_src = (const unsigned char *)src;
+
+    if(size <= 0 || b_dest == b_src) return dest;
+    if(LOAD_ACQUIRE(&KERNELS_READY) != 2) select_kernels();
+
+    /* only a destination inside the source has to be copied back to front */
+    if(b_dest > b_src && b_dest < b_src + size) COPY_BACKWARD(b_dest, b_src, size);
+    else COPY_FORWARD(b_dest, b_src, size);
+
+    return dest;
+}
+
+static void *memset(void *dest, int value, int size)
+{
+    if(size <= 0) return dest;
+    if(LOAD_ACQUIRE(&KERNELS_READY) != 2) select_kernels();
+
+    SET_MEMORY((unsigned char *)dest, value, size);
+
+    return dest;
+}
+
+static int memcmp(void *a, void *b, int size)
+{
+    if(size <= 0 || a == b) return 0;
+    if(LOAD_ACQUIRE(&KERNELS_READY) != 2) select_kernels();
+
+    return COMPARE_MEMORY((const unsigned char *)a, (const unsigned char *)b, size);
+}
+
+static void *memchr(void *ptr, int value, int size)
+{
+    if(size <= 0) return NULL;
+    if(LOAD_ACQUIRE(&KERNELS_READY) != 2) select_kernels();
+
+    int offset = FIND_MEMORY((const unsigned char *)ptr, value, size);
+
+    return offset < 0 ? NULL : (unsigned char *)ptr + offset;
+}
+
+/* runs without the heap lock; a slot that changes while it is read
+ * shows a different base the second time and is skipped, which is
+ * right since no live block can be in a region coming or going */
+static int onheap(void *ptr)
+{
+    unsigned char *b_ptr = (unsigned char *)ptr;
+    int count = LOAD_ACQUIRE(&REGION_COUNT), i;
+
+    for(i = 0; i < count; i++)
+    {
+        unsigned char *base = LOAD_ACQUIRE(&REGIONS[i].base);
+
+        if(base == NULL || b_ptr < base + 2 * HEADER_SIZE) continue;
+        if(b_ptr < LOAD_ACQUIRE(&REGIONS[i].end) && LOAD_ACQUIRE(&REGIONS[i].base) == base) return 1;
+    }
+
+    return 0;
+}
+
+static int memuse(void)
+{
+    return (int)ATOMIC_LOAD(&IN_USE);
+}
+
+static int heap_init(void *buffer, int size)
+{
+    heap_lock();
+
+    struct region *region = add_region(buffer, size, 0, 0);
+
+    heap_unlock();
+
+    return region != NULL;
+}
+
+static void *aligned_malloc(int alignment, int size)
+{
+    if(alignment <= 0 || (alignment & (alignment - 1))) return NULL;
+    if(alignment <= MEMORY_ALIGNMENT) return malloc(size);
+    if(size <= 0 || size > 0x7fffffff / 2 - alignment) return NULL;
+
+    int needed = PAYLOAD_SIZE(size);
+    if(needed < MIN_PAYLOAD) needed = MIN_PAYLOAD;
+
+    heap_lock();
+
+    struct block *current = take_aligned_block(alignment, needed);
+
+    heap_unlock();
+
+    if(current == NULL) return NULL;
+
+    count_allocation(size, BLOCK_SIZE(current));
+
+    return BLOCK_DATA(current);
+}
+
+static void aligned_free(void *ptr)
+{
+    free(ptr);
+}
+
+static void *cacheline_malloc(int size)
+{
+    if(size <= 0 || size > 0x7fffffff / 2 - MEMORY_CACHE_LINE) return NULL;
+
+    return aligned_malloc(MEMORY_CACHE_LINE, (size + MEMORY_CACHE_LINE - 1) & ~(MEMORY_CACHE_LINE - 1));
+}
+
+static void memstats(struct memory_stats *stats)
+{
+    int i;
+
+    stats->in_use = ATOMIC_LOAD(&IN_USE);
+    stats->peak = ATOMIC_LOAD(&PEAK_USE);
+    stats->allocations = ATOMIC_LOAD(&ALLOCATIONS);
+    stats->frees = ATOMIC_LOAD(&FREES);
+
+    for(i = 0; i < SIZE_CLASSES; i++) stats->class_allocations[i] = ATOMIC_LOAD(&CLASS_ALLOCATIONS[i]);
+    for(i = 0; i < 32; i++) stats->size_histogram[i] = ATOMIC_LOAD(&SIZE_HISTOGRAM[i]);
+
+    heap_lock();
+
+    stats->heap_size = HEAP_BYTES;
+    stats->free_bytes = FREE_BYTES;
+    stats->largest_free = 0;
+
+    /* the largest block is the rightmost in the tree, or else
+     * sits in the highest non-empty small class */
+    if(FREE_TREE)
+    {
+        struct block *current = FREE_TREE;
+
+        while(RIGHT(current)) current = RIGHT(current);
+
+        stats->largest_free = BLOCK_SIZE(current);
+    }
+    else if(FREE_CLASSES)
+    {
+        int index = 63;
+        struct block *current;
+
+        while(!(FREE_CLASSES & (1ULL << index))) index--;
+
+        for(current = FREE_BLOCKS[index]; current != NULL; current = ((struct free_links *)BLOCK_DATA(current))->next)
+            if(BLOCK_SIZE(current) > stats->largest_free) stats->largest_free = BLOCK_SIZE(current);
+    }
+
+    heap_unlock();
+
+    stats->fragmentation = stats->free_bytes ? 1.0 - (double)stats->largest_free / stats->free_bytes : 0.0;
+}
+
+static int malloc_batch(int count, int size, void **ptrs)
+{
+    if(count <= 0 || ptrs == NULL || size <= 0 || size > MAX_REQUEST) return 0;
+
+    int needed = PAYLOAD_SIZE(size);
+    if(needed < MIN_PAYLOAD) needed = MIN_PAYLOAD;
+
+    struct block *current = NULL;
+    int taken = 0;
+
+    heap_lock();
+
+    /* one block for the whole batch, cut up in place: every block but the
+     * last gets exactly the needed size, the last keeps any slack */
+    if(count <= MAX_REQUEST / (needed + HEADER_SIZE))
+        current = take_block(count * (needed + HEADER_SIZE) - HEADER_SIZE, NULL);
+
+    if(current != NULL)
+    {
+        int size_left = BLOCK_SIZE(current);
+
+        for(taken = 0; taken < count - 1; taken++)
+        {
+            SET_SIZE(current, needed);
+            size_left -= needed + HEADER_SIZE;
+
+            struct block *next = NEXT_BLOCK(current);
+
+            STORE_WORD(&next->size, 0u);
+            SET_SIZE(next, size_left);
+            SET_STATE(next, BLOCK_USED);
+            next->prev_size = needed;
+
+            ptrs[taken] = BLOCK_DATA(current);
+            current = next;
+        }
+
+        NEXT_BLOCK(current)->prev_size = BLOCK_SIZE(current);
+        ptrs[taken++] = BLOCK_DATA(current);
+    }
+    else
+    {
+        for(taken = 0; taken < count; taken++)
+        {
+            current = take_block(needed, NULL);
+
+            if(current == NULL) break;
+
+            ptrs[taken] = BLOCK_DATA(current);
+        }
+    }
+
+    heap_unlock();
+
+    int i;
+
+    for(i = 0; i < taken; i++) count_allocation(size, BLOCK_SIZE(DATA_BLOCK(ptrs[i])));
+
+    return taken;
+}
+
+static void free_batch(void **ptrs, int count)
+{
+    int i;
+
+    if(ptrs == NULL) return;
+
+    heap_lock();
+
+    /* first mark the whole batch, so neighbours within it can be told
+     * apart from blocks that stay in use */
+    for(i = 0; i < count; i++)
+    {
+        if(!onheap(ptrs[i]) || BLOCK_STATE(DATA_BLOCK(ptrs[i])) != BLOCK_USED) continue;
+
+        count_free(BLOCK_SIZE(DATA_BLOCK(ptrs[i])));
+        SET_STATE(DATA_BLOCK(ptrs[i]), BLOCK_BATCHED);
+    }
+
+    /* then release each run of marked blocks as one; the first member of
+     * a run that comes up handles all of it, and the headers swallowed
+     * by the run are left marked free so the others are skipped */
+    for(i = 0; i < count; i++)
+    {
+        if(!onheap(ptrs[i]) || BLOCK_STATE(DATA_BLOCK(ptrs[i])) != BLOCK_BATCHED) continue;
+
+        struct block *first = DATA_BLOCK(ptrs[i]), *next;
+
+        while(BLOCK_STATE(PREV_BLOCK(first)) == BLOCK_BATCHED) first = PREV_BLOCK(first);
+
+        while(BLOCK_STATE(next = NEXT_BLOCK(first)) == BLOCK_BATCHED)
+        {
+            SET_STATE(next, BLOCK_FREE);
+            SET_SIZE(first, BLOCK_SIZE(first) + HEADER_SIZE + BLOCK_SIZE(next));
+        }
+
+        SET_STATE(first, BLOCK_USED);
+        release_block(first);
+    }
+
+    heap_unlock();
+}
+
+/* empties the calling thread's cache and returns how many blocks it held */
+static int release_cache(void)
+{
+    int i, released = 0;
+
+    for(i = 0; i < SMALL_CLASSES; i++)
+    {
+        released += THREAD_CACHE.counts[i];
+
+        if(THREAD_CACHE.counts[i]) drain_cache(i, 0);
+    }
+
+    return released;
+}
+
+static void flush_thread_cache(void)
+{
+    release_cache();
+}
+
+static struct arena *arena_create(int size)
+{
+    if(size < 0) return NULL;
+
+    int offset = (int)ALIGN_UP(sizeof(struct arena));
+    struct arena *arena = (struct arena *)malloc(offset + size);
+
+    if(arena == NULL) return NULL;
+
+    arena->base = (unsigned char *)arena + offset;
+    arena->size = memsize(arena) - offset;
+    arena->used = 0;
+    arena->owned = 1;
+
+    return arena;
+}
+
+static struct arena *arena_wrap(void *buffer, int size)
+{
+    uintptr_t start = ALIGN_UP((uintptr_t)buffer);
+    uintptr_t base = ALIGN_UP(start + sizeof(struct arena));
+
+    if(buffer == NULL || size < 0 || base > (uintptr_t)buffer + size) return NULL;
+
+    struct arena *arena = (struct arena *)start;
+
+    arena->base = (unsigned char *)base;
+    arena->size = (int)((uintptr_t)buffer + size - base);
+    arena->used = 0;
+    arena->owned = 0;
+
+    return arena;
+}
+
+static void *arena_alloc(struct arena *arena, int size)
+{
+    if(size < 0 || size > arena->size - arena->used) return NULL;
+
+    void *ptr = arena->base + arena->used;
+
+    /* keep the next allocation aligned, even if it overshoots the end */
+    arena->used += (int)ALIGN_UP(size);
+    if(arena->used > arena->size) arena->used = arena->size;
+
+    return ptr;
+}
+
+static int arena_mark(struct arena *arena)
+{
+    return arena->used;
+}
+
+static void arena_reset(struct arena *arena, int mark)
+{
+    if(mark >= 0 && mark <= arena->used) arena->used = mark;
+}
+
+static void arena_destroy(struct arena *arena)
+{
+    if(arena != NULL && arena->owned) free(arena);
+}
+
+static struct pool *pool_create(int object_size)
+{
+    if(object_size <= 0) return NULL;
+
+    struct pool *pool = (struct pool *)malloc(sizeof(struct pool));
+
+    if(pool == NULL) return NULL;
+
+    /* slots keep MEMORY_ALIGNMENT like every other allocation; pages
+     * come from malloc() and slots start ALIGN_UP(sizeof(void *)) in */
+    pool->slot_size = (int)ALIGN_UP(object_size);
+    pool->page_slots = (MEMORY_POOL_PAGE - (int)ALIGN_UP(sizeof(void *))) / pool->slot_size;
+
+    if(pool->page_slots < 8) pool->page_slots = 8;
+
+    pool->free_slots = NULL;
+    pool->next_slot = NULL;
+    pool->page_end = NULL;
+    pool->pages = NULL;
+    pool->page_count = 0;
+    pool->used = 0;
+    pool->peak = 0;
+
+    return pool;
+}
+
+static void *pool_alloc(struct pool *pool)
+{
+    void *slot = pool->free_slots;
+
+    if(slot != NULL) pool->free_slots = *(void **)slot;
+    else
+    {
+        if(pool->next_slot == pool->page_end)
+        {
+            /* pages are chained through their first word and carved lazily */
+            int offset = (int)ALIGN_UP(sizeof(void *));
+            unsigned char *page = (unsigned char *)malloc(offset + pool->page_slots * pool->slot_size);
+
+            if(page == NULL) return NULL;
+
+            *(void **)page = pool->pages;
+
+            pool->pages = page;
+            pool->page_count++;
+            pool->next_slot = page + offset;
+            pool->page_end = pool->next_slot + pool->page_slots * pool->slot_size;
+        }
+
+        slot = pool->next_slot;
+        pool->next_slot += pool->slot_size;
+    }
+
+    if(++pool->used > pool->peak) pool->peak = pool->used;
+
+    return slot;
+}
+
+static void pool_free(struct pool *pool, void *ptr)
+{
+    if(ptr == NULL) return;
+
+    *(void **)ptr = pool->free_slots;
+    pool->free_slots = ptr;
+    pool->used--;
+}
+
+static void pool_stats(struct pool *pool, struct pool_stats *stats)
+{
+    stats->slot_size = pool->slot_size;
+    stats->pages = pool->page_count;
+    stats->capacity = pool->page_count * pool->page_slots;
+    stats->used = pool->used;
+    stats->peak = pool->peak;
+}
+
+static void pool_destroy(struct pool *pool)
+{
+    if(pool == NULL) return;
+
+    while(pool->pages != NULL)
+    {
+        void *page = pool->pages;
+
+        pool->pages = *(void **)page;
+        free(page);
+    }
+
+    free(pool);
+}
+
+#ifdef MEMORY_MMAP
+
+static int write_file(int fd, const void *data, long long size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+
+    while(size > 0)
+    {
+        long written = (long)write(fd, bytes, size > 0x40000000 ? 0x40000000 : (size_t)size);
+
+        if(written <= 0) return 0;
+
+        bytes += written;
+        size -= written;
+    }
+
+    return 1;
+}
+
+/* checks the block chain of a mapped snapshot, then hands it to the heap:
+ * whatever was free or sitting in a thread cache when the snapshot was
+ * taken is merged and put on the free lists, since their links still
+ * point into the old address space. The used blocks count as fresh
+ * allocations in the stats, by block size since requests are gone */
+static struct region *restore_region(unsigned char *memory, long long size, unsigned char *root)
+{
+    struct block *fence = (struct block *)memory;
+    struct block *last = (struct block *)(memory + size - HEADER_SIZE);
+    struct block *current, *run = NULL;
+    long long used = 0;
+    int rooted = 0;
+
+    if(BLOCK_SIZE(fence) != 0 || BLOCK_SIZE(last) != 0 || NEXT_BLOCK(fence)->prev_size != 0) return NULL;
+
+    for(current = NEXT_BLOCK(fence); current != last; current = NEXT_BLOCK(current))
+    {
+        long long left = (unsigned char *)last - (unsigned char *)current - HEADER_SIZE;
+
+        if(BLOCK_SIZE(current) < MIN_PAYLOAD || BLOCK_SIZE(current) > left) return NULL;
+        if((BLOCK_SIZE(current) + HEADER_SIZE) % MEMORY_ALIGNMENT != 0) return NULL;
+        if((int)NEXT_BLOCK(current)->prev_size != BLOCK_SIZE(current)) return NULL;
+
+        if(BLOCK_STATE(current) == BLOCK_USED && root >= (unsigned char *)BLOCK_DATA(current) && root < (unsigned char *)BLOCK_DATA(current) + BLOCK_SIZE(current)) rooted = 1;
+    }
+
+    if(!rooted) return NULL;
+
+    struct region *region = unused_region();
+
+    if(region == NULL) return NULL;
+
+    for(current = NEXT_BLOCK(fence); current != last; current = NEXT_BLOCK(current))
+    {
+        if(BLOCK_STATE(current) == BLOCK_USED)
+        {
+            if(run != NULL) insert_free(run);
+
+            used += BLOCK_SIZE(current);
+            run = NULL;
+
+            ATOMIC_ADD(&ALLOCATIONS, 1);
+            ATOMIC_ADD(&CLASS_ALLOCATIONS[size_class(BLOCK_SIZE(current))], 1);
+            ATOMIC_ADD(&SIZE_HISTOGRAM[highest_bit((unsigned int)BLOCK_SIZE(current))], 1);
+        }
+        else if(run != NULL)
+        {
+            SET_SIZE(run, BLOCK_SIZE(run) + HEADER_SIZE + BLOCK_SIZE(current));
+            NEXT_BLOCK(run)->prev_size = BLOCK_SIZE(run);
+
+            current = run;
+        }
+        else
+        {
+            SET_STATE(current, BLOCK_FREE);
+            run = current;
+        }
+    }
+
+    if(run != NULL) insert_free(run);
+
+    region->size = (int)size;
+    region->mapped = 1;
+    region->clean = (unsigned char *)last;
+
+    STORE_RELEASE(&region->end, (unsigned char *)last);
+    STORE_RELEASE(&region->base, memory);
+
+    if(region - REGIONS >= REGION_COUNT) STORE_RELEASE(&REGION_COUNT, (int)(region - REGIONS) + 1);
+
+    MAPPED_REGIONS++;
+    HEAP_BYTES += region->size;
+    raise_peak(ATOMIC_ADD(&IN_USE, used) + used);
+
+    return region;
+}
+
+static int heap_snapshot(const char *path, void *root)
+{
+    struct snapshot_header header;
+    long page = sysconf(_SC_PAGESIZE);
+    int result = 0;
+
+    /* blocks in the caller's cache go back to the heap first, those of
+     * other threads come back free in heap_restore() */
+    flush_thread_cache();
+
+    heap_lock();
+
+    struct region *region = region_of(root);
+
+    if(region != NULL && onheap(root))
+    {
+        unsigned char *fence = (unsigned char *)ALIGN_UP((uintptr_t)region->base);
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, (void *)SNAPSHOT_MAGIC, 8);
+
+        header.offset = ((long long)sizeof(header) + page - 1) / page * page;
+        header.size = region->end + HEADER_SIZE - fence;
+        header.root = (unsigned char *)root - fence;
+        header.alignment = MEMORY_ALIGNMENT;
+        header.header_size = HEADER_SIZE;
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if(fd >= 0)
+        {
+            result = write_file(fd, &header, sizeof(header)) && lseek(fd, (off_t)header.offset, SEEK_SET) == (off_t)header.offset && write_file(fd, fence, header.size);
+
+            if(close(fd) != 0) result = 0;
+        }
+    }
+
+    heap_unlock();
+
+    return result;
+}
+
+static void *heap_restore(const char *path)
+{
+    struct snapshot_header header;
+    long page = sysconf(_SC_PAGESIZE);
+    int fd = open(path, O_RDONLY);
+
+    if(fd < 0) return NULL;
+
+    long long file_size = (long long)lseek(fd, 0, SEEK_END);
+
+    if(lseek(fd, 0, SEEK_SET) != 0 || read(fd, &header, sizeof(header)) != (long)sizeof(header) || memcmp(header.magic, (void *)SNAPSHOT_MAGIC, 8) != 0 ||
+       header.alignment != MEMORY_ALIGNMENT || header.header_size != HEADER_SIZE || header.offset % page != 0 ||
+       header.size < 3 * HEADER_SIZE + MIN_PAYLOAD || header.offset + header.size != file_size || header.size > 0x7fffffff ||
+       header.root < 2 * HEADER_SIZE || header.root >= header.size)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    /* the region is page aligned in the file, so it maps on its own */
+    void *memory = mmap(NULL, (size_t)header.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)header.offset);
+
+    close(fd);
+
+    if(memory == MAP_FAILED) return NULL;
+
+    heap_lock();
+
+    struct region *region = restore_region((unsigned char *)memory, header.size, (unsigned char *)memory + header.root);
+
+    heap_unlock();
+
+    if(region == NULL)
+    {
+        munmap(memory, (size_t)header.size);
+        return NULL;
+    }
+
+    return (unsigned char *)memory + header.root;
+}
+
+#endif
+
 #endif
@@ -0,0 +1,154 @@
+/* kernels.c - measures the string.h kernels on 1 KB to 100 MB inputs
+ *
+ *     gcc -O2 string/bench/kernels.c -o kernels
+ *     ./kernels
+ *
+ * Each kernel runs in its portable, SSE2 and AVX2 form, as far as the
+ * CPU has them, over the same input. Small inputs are repeated until
+ * every measurement covers at least BYTES_PER_RUN bytes, and the best
+ * of RUNS measurements is reported in GB/s.
+ *
+ * GCC turns the portable count_chars loop into a call to the libc
+ * strlen(), so that column shows the libc figures.
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "../string.h"
+#include <stdio.h>
+#include <time.h>
+
+#define BYTES_PER_RUN (256LL << 20)
+#define RUNS 3
+
+/*---------------------------------------------------------------------------*/
+/*                              Data Structures                              */
+/*---------------------------------------------------------------------------*/
+
+/* one way of running every kernel */
+struct kernel_set
+{
+    const char *name;
+    int available;
+    int (*count_chars)(const char *);
+    void (*change_case)(char *, int, char, char);
+    int (*count_mismatches)(const char *, const char *, int);
+};
+
+/*------------------------------------------------------------------------------------*/
+/*                              Function Implementations                              */
+/*------------------------------------------------------------------------------------*/
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* volatile so the compiler cannot drop the kernel calls */
+static volatile int SINK;
+
+static double measure(const struct kernel_set *set, int kernel, char *a, char *b, int size)
+{
+    long long repeats = BYTES_PER_RUN / size + 1, i;
+    double best = 0.0;
+    int run;
+
+    for(run = 0; run < RUNS; run++)
+    {
+        double start = now();
+
+        for(i = 0; i < repeats; i++)
+        {
+            switch(kernel)
+            {
+                case 0: SINK = set->count_chars(a); break;
+                case 1: set->change_case(a, size, 'a', 'z'); set->change_case(a, size, 'A', 'Z'); break;
+                case 2: SINK = set->count_mismatches(a, b, size); break;
+            }
+        }
+
+        /* case conversion goes over the input twice per repeat */
+        double rate = (double)size * repeats * (kernel == 1 ? 2 : 1) / (now() - start) / 1e9;
+
+        if(rate > best) best = rate;
+    }
+
+    return best;
+}
+
+int main(void)
+{
+    static const int sizes[] = { 1 << 10, 16 << 10, 1 << 20, 16 << 20, 100 << 20 };
+    static const char *kernels[] = { "count_chars", "toupper/tolower", "compare_strings" };
+
+#ifdef STRING_X86
+    __builtin_cpu_init();
+#endif
+
+    struct kernel_set sets[] =
+    {
+        { "portable", 1, count_chars_bytes, change_case_bytes, count_mismatches_bytes },
+#ifdef STRING_X86
+        { "sse2", __builtin_cpu_supports("sse2"), count_chars_sse2, change_case_sse2, count_mismatches_sse2 },
+        { "avx2", __builtin_cpu_supports("avx2"), count_chars_avx2, change_case_avx2, count_mismatches_avx2 },
+#endif
+    };
+
+    int set_count = (int)(sizeof(sets) / sizeof(sets[0]));
+    int largest = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    char *a = (char *)malloc((size_t)largest + 1), *b = (char *)malloc((size_t)largest + 1);
+    int i, j, k;
+
+    if(a == NULL || b == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    /* mixed case text, with one byte in 64 different between a and b */
+    for(i = 0; i < largest; i++)
+    {
+        a[i] = (char)((i % 3 ? 'a' : 'A') + i % 26);
+        b[i] = i % 64 ? a[i] : '#';
+    }
+
+    a[largest] = b[largest] = 0;
+
+    for(k = 0; k < 3; k++)
+    {
+        printf("%s, GB/s\n%10s", kernels[k], "");
+
+        for(j = 0; j < set_count; j++) printf("%10s", sets[j].name);
+        printf("\n");
+
+        for(i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+        {
+            int size = sizes[i];
+            char saved = a[size];
+
+            /* count_chars needs the terminator right at the end */
+            a[size] = 0;
+
+            printf("%7d KB", size >> 10);
+
+            for(j = 0; j < set_count; j++)
+            {
+                if(sets[j].available) printf("%10.2f", measure(&sets[j], k, a, b, size));
+                else printf("%10s", "-");
+            }
+
+            printf("\n");
+            a[size] = saved;
+        }
+
+        printf("\n");
+    }
+
+    free(a);
+    free(b);
+
+    return 0;
+}
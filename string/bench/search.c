@@ -0,0 +1,143 @@
+/* search.c - measures find_string() and rfind_string() on 1 KB to 100 MB inputs
+ *
+ *     gcc -O2 string/bench/search.c -o search
+ *     ./search
+ *
+ * The haystack is pseudo random lowercase text that the needles never
+ * occur in, so every search runs to the end. Short needles go through
+ * the portable, SSE2 and AVX2 first and last character kernels, as far
+ * as the CPU has them, long ones through the Two-Way search, which uses
+ * the same kernels to skip ahead. Small inputs are repeated until every
+ * measurement covers at least BYTES_PER_RUN bytes, and the best of RUNS
+ * measurements is reported in GB/s.
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "../string.h"
+#include <stdio.h>
+#include <time.h>
+
+#define BYTES_PER_RUN (256LL << 20)
+#define RUNS 3
+
+/*---------------------------------------------------------------------------*/
+/*                              Data Structures                              */
+/*---------------------------------------------------------------------------*/
+
+/* one way of running the search kernels */
+struct kernel_set
+{
+    const char *name;
+    int available;
+    int (*find_needle)(const char *, int, const char *, int);
+    int (*rfind_needle)(const char *, int, const char *, int);
+};
+
+/*------------------------------------------------------------------------------------*/
+/*                              Function Implementations                              */
+/*------------------------------------------------------------------------------------*/
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* volatile so the compiler cannot drop the searches */
+static volatile int SINK;
+
+static double measure(const struct kernel_set *set, int reverse, const char *haystack, int size, const char *needle, int needle_length)
+{
+    long long repeats = BYTES_PER_RUN / size + 1, i;
+    double best = 0.0;
+    int run;
+
+    FIND_NEEDLE = set->find_needle;
+    RFIND_NEEDLE = set->rfind_needle;
+
+    for(run = 0; run < RUNS; run++)
+    {
+        double start = now();
+
+        for(i = 0; i < repeats; i++) SINK = search_chars(haystack, size, needle, needle_length, reverse);
+
+        double rate = (double)size * repeats / (now() - start) / 1e9;
+
+        if(rate > best) best = rate;
+    }
+
+    return best;
+}
+
+int main(void)
+{
+    static const int sizes[] = { 1 << 10, 16 << 10, 1 << 20, 16 << 20, 100 << 20 };
+    static const char *searches[] = { "find_string, 8 characters", "rfind_string, 8 characters", "find_string, 64 characters", "rfind_string, 64 characters" };
+
+#ifdef STRING_X86
+    __builtin_cpu_init();
+#endif
+
+    struct kernel_set sets[] =
+    {
+        { "portable", 1, find_needle_bytes, rfind_needle_bytes },
+#ifdef STRING_X86
+        { "sse2", __builtin_cpu_supports("sse2"), find_needle_sse2, rfind_needle_sse2 },
+        { "avx2", __builtin_cpu_supports("avx2"), find_needle_avx2, rfind_needle_avx2 },
+#endif
+    };
+
+    int set_count = (int)(sizeof(sets) / sizeof(sets[0]));
+    int largest = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    char *haystack = (char *)malloc((size_t)largest), needle[64];
+    unsigned int seed = 1;
+    int i, j, k;
+
+    if(haystack == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    /* the needles hold an uppercase letter the haystack lacks */
+    for(i = 0; i < largest; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        haystack[i] = (char)('a' + (seed >> 16) % 26);
+    }
+
+    for(i = 0; i < 64; i++) needle[i] = haystack[i * 7];
+    needle[3] = needle[40] = 'Q';
+
+    select_string_kernels();
+
+    for(k = 0; k < 4; k++)
+    {
+        printf("%s, GB/s\n%10s", searches[k], "");
+
+        for(j = 0; j < set_count; j++) printf("%10s", sets[j].name);
+        printf("\n");
+
+        for(i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+        {
+            printf("%7d KB", sizes[i] >> 10);
+
+            for(j = 0; j < set_count; j++)
+            {
+                if(sets[j].available) printf("%10.2f", measure(&sets[j], k & 1, haystack, sizes[i], needle, k < 2 ? 8 : 64));
+                else printf("%10s", "-");
+            }
+
+            printf("\n");
+        }
+
+        printf("\n");
+    }
+
+    free(haystack);
+
+    return 0;
+}
@@ -11,8 +11,8 @@ int main(void)
 
     printf("%d\n", diff);
 
-    free(s1);
-    free(s2);
+    free_string(s1);
+    free_string(s2);
 
     return 0;
 }
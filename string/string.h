@@ -22,8 +22,51 @@
 #ifndef STRING_H
 #define STRING_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
+/* define STRING_NO_SIMD to keep to the portable loops */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && !defined(STRING_NO_SIMD)
+	#define STRING_X86
+	#include <immintrin.h>
+#endif
+
+#ifndef STRING_BUILDER_CHUNK
+	#define STRING_BUILDER_CHUNK (1024 * 1024) /* largest chunk a builder adds on its own */
+#endif
+
+#ifndef STRING_ROPE_LEAF
+	#define STRING_ROPE_LEAF 512 /* most characters a rope node holds */
+#endif
+
+#ifndef STRING_SEARCH_SHORT
+	#define STRING_SEARCH_SHORT 32 /* longest needle searched by first and last character alone */
+#endif
+
+#ifndef STRING_POOL_BLOCK
+	#define STRING_POOL_BLOCK (64 * 1024) /* bytes an arena backed pool allocates at once */
+#endif
+
+#ifndef STRING_POOL_SPINS
+	#define STRING_POOL_SPINS 64 /* pauses on a held pool lock before yielding the CPU */
+#endif
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+	#define LOAD_ACQUIRE(target) (*(target))
+	int __stdcall SwitchToThread(void);
+#elif defined(unix) || defined(__unix__) || defined(__unix) || defined(__APPLE__)
+	#include <sched.h>
+#endif
+
+#if !defined(_MSC_VER)
+	#define LOAD_ACQUIRE(target) __atomic_load_n((target), __ATOMIC_ACQUIRE)
+#endif
+
+/* flags for string_pool() */
+#define STRING_POOL_THREADS 1 /* lock the pool, so threads can share it */
+#define STRING_POOL_ARENA 2   /* carve the strings from large blocks freed with the pool */
+
 #ifdef SHORTER_NAMES
     #define sizstr resize_string
     #define cpystr copy_string
@@ -33,19 +76,171 @@
     #define slistr slice_string
     #define splstr split_string
     #define cmpstr compare_strings
+    #define frestr free_string
+    #define rsvstr reserve_string
+    #define intstr intern_string
+    #define fndstr find_string
+    #define rfnstr rfind_string
 #endif
 
 typedef char * string_t;
 
+/* every string_t points just past one of these, so its length is known
+ * without a scan while the pointer still reads as a plain C string */
+struct string_header
+{
+    int length, capacity; /* neither counts the terminator */
+};
+
+#define STRING_HEADER(str) ((struct string_header *)(str) - 1)
+
+/* a 24 byte handle that keeps up to SMALL_STRING_CAPACITY characters
+ * inline and anything longer in a string_t; the last byte holds the
+ * room left inline, which doubles as the terminator once it is full,
+ * or SMALL_STRING_HEAP when the characters live in str */
+struct small_string
+{
+    union
+    {
+        char chars[24];
+        string_t str;
+    } data;
+};
+
+#define SMALL_STRING_CAPACITY 23
+#define SMALL_STRING_HEAP 0xff
+#define SMALL_STRING_LEFT(small) ((unsigned char)(small)->data.chars[SMALL_STRING_CAPACITY])
+
+/* a window into characters owned by someone else, which is not
+ * terminated; chars is NULL when there is nothing to look at */
+struct string_view
+{
+    const char *chars;
+    int length;
+};
+
+/* what split_string() returns, in a single allocation that free()
+ * releases: piece i is the terminated string at chars + offsets[i],
+ * lengths[i] characters long, and offsets match the original string */
+struct string_split
+{
+    int count;
+    int *offsets, *lengths;
+    char *chars;
+};
+
+/* one chunk of a string_builder, with its characters right behind it */
+struct builder_chunk
+{
+    struct builder_chunk *next;
+    int used, capacity;
+};
+
+/* collects appended text in a list of chunks, which are never moved
+ * or copied until flatten_builder() copies each of them once */
+struct string_builder
+{
+    struct builder_chunk *first, *last;
+    int length;
+};
+
+/* a node of a string_rope, holding a piece of the text behind it; the
+ * nodes form a treap ordered by position, with priorities hashed from
+ * their addresses, and length covers the node's whole subtree. size is
+ * the characters in the piece and capacity how many fit behind it */
+struct rope_node
+{
+    struct rope_node *left, *right;
+    int length, size, capacity;
+};
+
+#define ROPE_CHARS(node) ((char *)((node) + 1))
+
+/* text kept in pieces, so inserting and deleting anywhere in it
+ * takes O(log n) instead of moving everything after the edit */
+struct string_rope
+{
+    struct rope_node *root;
+};
+
+/* one string of a string_pool, which reads as an ordinary string_t
+ * since its header comes right before the characters */
+struct intern_entry
+{
+    struct intern_entry *next;
+    unsigned int hash;
+    struct string_header header;
+};
+
+#define INTERN_CHARS(entry) ((string_t)(&(entry)->header + 1))
+
+/* a hash table of unique strings, which never move once interned */
+struct string_pool
+{
+    struct intern_entry **buckets;
+    int bucket_count, count, flags;
+    struct builder_chunk *blocks; /* the arena, newest block first */
+    volatile long lock;
+};
+
+/* the characters of a split format: up to 16 of them are kept as a
+ * list, which the vector kernels compare against, more than that go
+ * into a lookup table and count is 17 */
+struct delimiter_set
+{
+    int count;
+    unsigned char chars[16];
+    unsigned char table[256];
+};
+
+static int count_chars(const char *chars);
+static string_t create_string(const char *chars, int length);
+static void make_delimiter_set(struct delimiter_set *set, string_t format);
+static int find_delimiter_list(const char *chars, int length, const struct delimiter_set *set);
+static int find_delimiter_table(const char *chars, int length, const struct delimiter_set *set);
+static int count_chars_bytes(const char *chars);
+static void change_case_bytes(char *chars, int length, char first, char last);
+static int count_mismatches_bytes(const char *a, const char *b, int length);
+static int needle_at(const char *chars, const char *needle, int length);
+static int find_needle_bytes(const char *chars, int length, const char *needle, int needle_length);
+static int rfind_needle_bytes(const char *chars, int length, const char *needle, int needle_length);
+static void select_string_kernels(void);
+static int maximal_suffix(const char *needle, int length, int reverse, int invert, int *period);
+static int two_way_search(const char *chars, int length, const char *needle, int needle_length, int reverse);
+static int search_chars(const char *chars, int length, const char *needle, int needle_length, int reverse);
+static unsigned int rope_priority(struct rope_node *node);
+static int rope_length(struct rope_node *node);
+static struct rope_node *rope_update(struct rope_node *node);
+static struct rope_node *rope_piece(const char *chars, int size, int capacity);
+static struct rope_node *rope_merge(struct rope_node *a, struct rope_node *b);
+static void rope_split(struct rope_node *node, int index, struct rope_node **left, struct rope_node **right);
+static void rope_replace(struct rope_node **tree, struct rope_node *node, struct rope_node *piece, int last);
+static int rope_absorb(struct rope_node **left, struct rope_node **right, const char *chars, int length);
+static int rope_cut(struct string_rope *rope, int index, struct rope_node **left, struct rope_node **right);
+static void rope_copy(struct rope_node *node, char *dest);
+static void rope_free(struct rope_node *node);
+static unsigned int hash_chars(const char *chars, int length);
+static void pool_backoff(int *spins);
+static void pool_lock(struct string_pool *pool);
+static void pool_unlock(struct string_pool *pool);
+static struct intern_entry *pool_entry(struct string_pool *pool, int length);
+static int grow_pool(struct string_pool *pool);
+static int find_delimiter(const char *chars, int length, const struct delimiter_set *set);
+
 /**
  * Allocates a new string with the
- * specified value.
+ * specified value, which can be any C string.
 */
 static string_t string(string_t str);
 
 /**
- * Resizes the allocation of the specified
- * string to the specified size.
+ * Frees a string allocated by any of these functions.
+*/
+static void free_string(string_t str);
+
+/**
+ * Resizes the allocation of the specified string to the specified
+ * size, terminator included, cutting the string short if needed.
 */
 static string_t resize_string(string_t str, int size);
 
@@ -55,7 +250,7 @@ static string_t resize_string(string_t str, int size);
 static int copy_string(string_t dest, string_t src, int size);
 
 /**
- * Returns the count of characters in a string.
+ * Returns the count of characters in a string, in constant time.
 */
 static int count_string(string_t str);
 
@@ -66,13 +261,29 @@ static int count_string(string_t str);
 static string_t concat_strings(string_t str, string_t cat);
 
 /**
- * Returns the first specified string with the
- * second specified string appended to it.
+ * Makes room for at least the specified number of characters without
+ * another allocation, and returns the string, which may have moved.
+ * On failure NULL is returned and the string is left as it was.
+*/
+static string_t reserve_string(string_t str, int capacity);
+
+/**
+ * Appends the second specified string to the first in place and
+ * returns the first, which may have moved. The capacity grows
+ * geometrically, so a string built by appends is copied O(1) times
+ * per character on average. On failure NULL is returned and dest is
+ * left as it was.
 */
 static string_t append_string(string_t dest, string_t src);
 
 /**
- * Returns a new string taken from the specified string.
+ * Same as append_string() for length characters of any C string.
+*/
+static string_t append_chars(string_t dest, const char *chars, int length);
+
+/**
+ * Returns a new string with the characters from start up to,
+ * but not including, end of the specified string.
 */
 static string_t substring(string_t str, int start, int end);
 
@@ -82,51 +293,283 @@ static string_t substring(string_t str, int start, int end);
 static string_t *slice_string(string_t str, int index);
 
 /**
- * Returns a list of strings that were split from the
- * original string based on the specified format.
+ * Splits a string at every occurrence of any of the characters in
+ * format, scanning 16 or 32 bytes at a time where the CPU allows.
+ * The pieces, their offsets and lengths come back in a single
+ * allocation, see struct string_split, which is freed with free().
+*/
+static struct string_split *split_string(string_t str, string_t format);
+
+/**
+ * Splits a view like split_string() without allocating, calling the
+ * callback with each piece in turn until it returns 0. Returns the
+ * number of pieces passed to the callback.
+*/
+static int split_each(struct string_view view, string_t format, int (*callback)(struct string_view piece, void *data), void *data);
+
+/**
+ * Returns the index of the first occurrence of needle in the specified
+ * string, or -1. The needle can be any C string, measured up to its
+ * terminator; find_view() takes a view instead. An empty needle is
+ * found at 0. Needles up to STRING_SEARCH_SHORT characters are looked
+ * for 16 or 32 positions at a time by their first and last character,
+ * longer ones with the Two-Way algorithm, which never takes more than
+ * linear time.
+*/
+static int find_string(string_t str, const char *needle);
+
+/**
+ * Same as find_string() for the last occurrence. An empty
+ * needle is found at the end of the string.
+*/
+static int rfind_string(string_t str, const char *needle);
+
+/**
+ * Returns the number of occurrences of needle, which can be any C
+ * string, in the specified string that do not overlap, counted from
+ * the start. An empty needle has none.
+*/
+static int count_occurrences(string_t str, const char *needle);
+
+/**
+ * Modifies the specified string to make all letters uppercase, up to
+ * its terminator. It can be any C string, not only a string_t.
+*/
+static void toupper(char *str);
+
+/**
+ * Modifies the specified string to make all letters lowercase, up to
+ * its terminator. It can be any C string, not only a string_t.
+*/
+static void tolower(char *str);
+
+/**
+ * Compares two strings up to their terminators and returns the number
+ * of different characters, or -1 if either is NULL. They can be any
+ * C strings.
+*/
+static int compare_strings(const char *a, const char *b);
+
+/**
+ * Sets up a small string with the specified value, which can be any
+ * C string. Values up to SMALL_STRING_CAPACITY characters are kept in
+ * the handle itself without allocating. Returns 1 on success.
+*/
+static int small_string(struct small_string *small, const char *chars);
+
+/**
+ * Returns the characters of a small string as a terminated C string.
+ * It is not a string_t, so it has no header for the string functions;
+ * use view_small_string() to pass it to the view functions instead.
+ * The pointer is only valid until the small string changes or moves.
+*/
+static char *small_string_chars(struct small_string *small);
+
+/**
+ * Returns the count of characters in a small string.
+*/
+static int count_small_string(struct small_string *small);
+
+/**
+ * Appends length characters to a small string, moving it to the heap
+ * once it outgrows the handle. Returns 1 on success.
+*/
+static int append_small_string(struct small_string *small, const char *chars, int length);
+
+/**
+ * Frees the heap storage of a small string, if it has any.
+*/
+static void free_small_string(struct small_string *small);
+
+/**
+ * Returns a view of a whole string.
+*/
+static struct string_view view_string(string_t str);
+
+/**
+ * Returns a view of length characters of any C string,
+ * or up to its terminator when length is negative.
+*/
+static struct string_view view_chars(const char *chars, int length);
+
+/**
+ * Returns a view of the characters of a small string, valid
+ * until the small string changes or moves.
+*/
+static struct string_view view_small_string(struct small_string *small);
+
+/**
+ * Returns a view of the characters from start up to, but not
+ * including, end of the specified view, without copying.
+*/
+static struct string_view substring_view(struct string_view view, int start, int end);
+
+/**
+ * Stores views of each side of the specified index in halves,
+ * like slice_string(), without copying. Returns 1 on success.
+*/
+static int slice_view(struct string_view view, int index, struct string_view *halves);
+
+/**
+ * Takes the next piece off the front of rest, up to the first of the
+ * characters in format, and stores it in piece. Call it until it
+ * returns 0 to walk all the pieces without allocating.
+*/
+static int split_view(struct string_view *rest, string_t format, struct string_view *piece);
+
+/**
+ * Returns the specified view without leading and trailing whitespace.
+*/
+static struct string_view trim_view(struct string_view view);
+
+/**
+ * Returns the index of the first occurrence of needle
+ * in the specified view, or -1.
+*/
+static int find_view(struct string_view view, struct string_view needle);
+
+/**
+ * Copies the characters of a view into a new string.
+*/
+static string_t view_to_string(struct string_view view);
+
+/**
+ * Sets up an empty string builder.
+*/
+static void string_builder(struct string_builder *builder);
+
+/**
+ * Appends length characters to a builder without moving anything
+ * appended before. Returns 1 on success.
+*/
+static int append_builder(struct string_builder *builder, const char *chars, int length);
+
+/**
+ * Returns everything appended to a builder as a new string,
+ * copying each character once. The builder stays as it was.
+*/
+static string_t flatten_builder(struct string_builder *builder);
+
+/**
+ * Frees the chunks of a builder and leaves it empty.
+*/
+static void free_builder(struct string_builder *builder);
+
+/**
+ * Sets up a rope holding length characters of any C string,
+ * or up to its terminator when length is negative. Returns 1 on success.
+*/
+static int string_rope(struct string_rope *rope, const char *chars, int length);
+
+/**
+ * Returns the count of characters in a rope.
+*/
+static int count_rope(struct string_rope *rope);
+
+/**
+ * Inserts length characters before the specified index of a rope,
+ * in O(log n) plus the length of the insert. Returns 1 on success.
+*/
+static int insert_rope(struct string_rope *rope, int index, const char *chars, int length);
+
+/**
+ * Deletes length characters of a rope from the specified
+ * index on, in O(log n). Returns 1 on success.
+*/
+static int delete_rope(struct string_rope *rope, int index, int length);
+
+/**
+ * Returns the text of a rope as a new string.
 */
-static string_t *split_string(string_t str, string_t format);
+static string_t flatten_rope(struct string_rope *rope);
 
 /**
- * Modifies the specified string to make all letters uppercase.
+ * Frees the nodes of a rope and leaves it empty.
 */
-static void toupper(string_t str);
+static void free_rope(struct string_rope *rope);
 
 /**
- * Modifies the specified string to make all letters lowercase.
+ * Sets up an empty string pool. The flags are any of
+ * STRING_POOL_THREADS and STRING_POOL_ARENA. Returns 1 on success.
 */
-static void tolower(string_t str);
+static int string_pool(struct string_pool *pool, int flags);
 
 /**
- * Compares two strings and returns the number of different characters.
+ * Returns the pool's copy of length characters of any C string, or up
+ * to its terminator when length is negative, adding it on first sight.
+ * The copy stays at the same address until the pool is freed, so equal
+ * strings from one pool compare equal as pointers. It must not be
+ * changed or freed on its own. Returns NULL if memory runs out.
 */
-static int compare_strings(string_t a, string_t b);
+static string_t intern_string(struct string_pool *pool, const char *chars, int length);
+
+/**
+ * Frees a pool and every string in it.
+*/
+static void free_pool(struct string_pool *pool);
+
+/* kernels picked for the running CPU by select_string_kernels(), which
+ * moves KERNELS_READY from 0 to 1 while it picks and to 2 once done */
+static volatile long KERNELS_READY = 0;
+static int (*FIND_DELIMITER)(const char *, int, const struct delimiter_set *) = NULL;
+static int (*COUNT_CHARS)(const char *) = NULL;
+static void (*CHANGE_CASE)(char *, int, char, char) = NULL;
+static int (*COUNT_MISMATCHES)(const char *, const char *, int) = NULL;
+static int (*FIND_NEEDLE)(const char *, int, const char *, int) = NULL;
+static int (*RFIND_NEEDLE)(const char *, int, const char *, int) = NULL;
 
 /*----------------------------------------------------------------------------*/
 /*                          Function Implementations                          */
 /*----------------------------------------------------------------------------*/
 
-static string_t string(string_t str)
+static int count_chars(const char *chars)
 {
-    if(str == NULL) return NULL;
+    if(LOAD_ACQUIRE(&KERNELS_READY) != 2) select_string_kernels();
 
-    int len = string_length(str) + 1;
-    string_t new_str = (string_t)malloc(sizeof(char) * len);
+    return COUNT_CHARS(chars);
+}
 
-    if(new_str == NULL) return NULL;
+static string_t create_string(const char *chars, int length)
+{
+    struct string_header *header = (struct string_header *)malloc(sizeof(struct string_header) + length + 1);
+
+    if(header == NULL) return NULL;
+
+    header->length = header->capacity = length;
+
+    string_t new_str = (string_t)(header + 1);
 
-    string_copy(new_str, str, len);
+    if(chars != NULL) copy_string(new_str, (string_t)chars, length);
+    new_str[length] = 0;
 
     return new_str;
 }
 
+static string_t string(string_t str)
+{
+    if(str == NULL) return NULL;
+
+    return create_string(str, count_chars(str));
+}
+
+static void free_string(string_t str)
+{
+    if(str != NULL) free(STRING_HEADER(str));
+}
+
 static string_t resize_string(string_t str, int size)
 {
     if(str == NULL || size <= 0) return NULL;
 
-    str = (string_t)realloc(str, sizeof(char) * size);
+    struct string_header *header = (struct string_header *)realloc(STRING_HEADER(str), sizeof(struct string_header) + size);
 
-    if(str == NULL) return NULL;
+    if(header == NULL) return NULL;
+
+    header->capacity = size - 1;
+    if(header->length > header->capacity) header->length = header->capacity;
+
+    str = (string_t)(header + 1);
+    str[header->length] = 0;
 
     return str;
 }
@@ -145,112 +588,1694 @@ static int count_string(string_t str)
 {
     if(str == NULL) return -1;
 
-    int i;
-    for(i = 0; str[i] != 0; i++);
-
-    return i;
+    return STRING_HEADER(str)->length;
 }
 
 static string_t concat_strings(string_t str, string_t cat)
 {
-    int str_len = string_length(str), cat_len = string_length(cat) + 1;
+    if(str == NULL || cat == NULL) return NULL;
+
+    int str_len = count_string(str), cat_len = count_string(cat);
 
-    string_t new_str = (string_t)malloc(sizeof(char) * (str_len + cat_len));
+    string_t new_str = create_string(NULL, str_len + cat_len);
 
     if(new_str == NULL) return NULL;
 
-    string_copy(new_str, str, str_len);
-    string_copy(new_str + str_len, cat, cat_len);
+    copy_string(new_str, str, str_len);
+    copy_string(new_str + str_len, cat, cat_len);
 
     return new_str;
 }
 
+static string_t reserve_string(string_t str, int capacity)
+{
+    if(str == NULL || capacity < 0 || capacity > 0x7fffffff - (int)sizeof(struct string_header) - 1) return NULL;
+    if(capacity <= STRING_HEADER(str)->capacity) return str;
+
+    return resize_string(str, capacity + 1);
+}
+
 static string_t append_string(string_t dest, string_t src)
 {
     if(dest == NULL || src == NULL) return NULL;
 
-    string_t new_str = string_concat(dest, src);
+    /* appending a string to itself has to copy from where it ends up */
+    if(src == dest)
+    {
+        int length = count_string(dest);
 
-    if(new_str == NULL) return NULL;
+        dest = append_chars(dest, NULL, length);
+        if(dest != NULL) copy_string(dest + length, dest, length);
 
-    free(dest);
-    free(src);
+        return dest;
+    }
 
-    return new_str;
+    return append_chars(dest, src, count_string(src));
 }
 
-static string_t substring(string_t str, int start, int end)
+static string_t append_chars(string_t dest, const char *chars, int length)
 {
-    string_t new_str = (string_t)malloc(sizeof(char) * (start + end + 1));
+    if(dest == NULL || length < 0) return NULL;
 
-    if(new_str == NULL) return NULL;
+    struct string_header *header = STRING_HEADER(dest);
 
-    string_copy(new_str, str + start, start + end);
-    new_str[start + end] = 0;
+    if(length > 0x7fffffff / 2 - header->length) return NULL;
 
-    return new_str;
+    int needed = header->length + length;
+
+    if(needed > header->capacity)
+    {
+        int capacity = header->capacity < 0x3fffffff ? header->capacity * 2 : needed;
+
+        if(capacity < needed) capacity = needed;
+        if(capacity < 16) capacity = 16;
+
+        dest = reserve_string(dest, capacity);
+        if(dest == NULL) return NULL;
+
+        header = STRING_HEADER(dest);
+    }
+
+    if(chars != NULL) copy_string(dest + header->length, (string_t)chars, length);
+
+    header->length = needed;
+    dest[needed] = 0;
+
+    return dest;
+}
+
+static string_t substring(string_t str, int start, int end)
+{
+    return view_to_string(substring_view(view_string(str), start, end));
 }
 
 static string_t *slice_string(string_t str, int index)
 {
-    int length = string_length(str);
+    struct string_view halves[2];
+
+    if(!slice_view(view_string(str), index, halves)) return NULL;
+
     string_t *sliced = (string_t *)malloc(sizeof(string_t) * 2);
 
     if(sliced == NULL) return NULL;
 
-    sliced[0] = (string_t)malloc(sizeof(char) * (index + 1));
-    sliced[1] = (string_t)malloc(sizeof(char) * (length - index + 1));
+    sliced[0] = view_to_string(halves[0]);
+    sliced[1] = view_to_string(halves[1]);
 
-    string_copy(sliced[0], str, index);
-    string_copy(sliced[1], str + index + 1, length - index);
+    if(sliced[0] == NULL || sliced[1] == NULL)
+    {
+        free_string(sliced[0]);
+        free_string(sliced[1]);
+        free(sliced);
 
-    sliced[0][index] = 0;
-    sliced[0][length - index] = 0;
+        return NULL;
+    }
 
     return sliced;
 }
 
-static string_t *split_string(string_t str, string_t format)
+static void make_delimiter_set(struct delimiter_set *set, string_t format)
+{
+    int i, j;
+
+    set->count = 0;
+
+    for(i = 0; format[i] != 0; i++)
+    {
+        for(j = 0; j < set->count && set->chars[j] != (unsigned char)format[i]; j++);
+
+        if(j < set->count) continue;
+
+        if(set->count == 16)
+        {
+            for(j = 0; j < 256; j++) set->table[j] = 0;
+            for(j = 0; format[j] != 0; j++) set->table[(unsigned char)format[j]] = 1;
+
+            set->count = 17;
+            return;
+        }
+
+        set->chars[set->count++] = (unsigned char)format[i];
+    }
+}
+
+/* the kernels return the offset of the first delimiter or -1 */
+static int find_delimiter_list(const char *chars, int length, const struct delimiter_set *set)
 {
-    int split_count = 0;
-    string_t *split = (string_t *)malloc(sizeof(string_t));
+    int i, j;
 
+    for(i = 0; i < length; i++)
+        for(j = 0; j < set->count; j++)
+            if((unsigned char)chars[i] == set->chars[j]) return i;
 
+    return -1;
 }
 
-static void toupper(string_t str)
+static int find_delimiter_table(const char *chars, int length, const struct delimiter_set *set)
 {
     int i;
-    for(i = 0; str[i] != 0; i++)
-    {
-        if(str[i] >= 97 && str[i] <= 122)
-            str[i] -= 32;
-    }
+
+    for(i = 0; i < length; i++)
+        if(set->table[(unsigned char)chars[i]]) return i;
+
+    return -1;
 }
 
-static void tolower(string_t str)
+static int count_chars_bytes(const char *chars)
 {
     int i;
-    for(i = 0; str[i] != 0; i++)
-    {
-        if(str[i] >= 65 && str[i] <= 90)
-            str[i] += 32;
-    }
+    for(i = 0; chars[i] != 0; i++);
+
+    return i;
 }
 
-static int compare_strings(string_t a, string_t b)
+/* flips the case bit of every character from first to last */
+static void change_case_bytes(char *chars, int length, char first, char last)
 {
-    int i, diff = string_length(a) - string_length(b);
+    int i;
 
-    if(diff < 0) diff *= -1;
+    for(i = 0; i < length; i++)
+        if(chars[i] >= first && chars[i] <= last) chars[i] ^= 32;
+}
+
+static int count_mismatches_bytes(const char *a, const char *b, int length)
+{
+    int i, count = 0;
 
-    for(i = 0; a[i] != 0; i++)
+    for(i = 0; i < length; i++)
+        if(a[i] != b[i]) count++;
+
+    return count;
+}
+
+/* compares all but the first and last characters, which the
+ * search kernels below have already matched */
+static int needle_at(const char *chars, const char *needle, int length)
+{
+    int i;
+
+    for(i = 1; i < length - 1; i++)
+        if(chars[i] != needle[i]) return 0;
+
+    return 1;
+}
+
+static int find_needle_bytes(const char *chars, int length, const char *needle, int needle_length)
+{
+    char first = needle[0], last = needle[needle_length - 1];
+    int i;
+
+    for(i = 0; i <= length - needle_length; i++)
+        if(chars[i] == first && chars[i + needle_length - 1] == last && needle_at(chars + i, needle, needle_length)) return i;
+
+    return -1;
+}
+
+static int rfind_needle_bytes(const char *chars, int length, const char *needle, int needle_length)
+{
+    char first = needle[0], last = needle[needle_length - 1];
+    int i;
+
+    for(i = length - needle_length; i >= 0; i--)
+        if(chars[i] == first && chars[i + needle_length - 1] == last && needle_at(chars + i, needle, needle_length)) return i;
+
+    return -1;
+}
+
+#ifdef STRING_X86
+
+/* compares every chunk against each delimiter in turn, which beats the
+ * table for the handful of delimiters formats usually have */
+__attribute__((target("sse2")))
+static int find_delimiter_sse2(const char *chars, int length, const struct delimiter_set *set)
+{
+    __m128i delimiters[16];
+    int i, offset = 0;
+
+    for(i = 0; i < set->count; i++) delimiters[i] = _mm_set1_epi8((char)set->chars[i]);
+
+    while(length - offset >= 16)
     {
-        if(b[i] == 0) break;
-        if(a[i] != b[i]) diff++;
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(chars + offset));
+        __m128i hits = _mm_cmpeq_epi8(chunk, delimiters[0]);
+
+        for(i = 1; i < set->count; i++) hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, delimiters[i]));
+
+        int mask = _mm_movemask_epi8(hits);
+
+        if(mask) return offset + __builtin_ctz(mask);
+
+        offset += 16;
     }
 
-    return diff;
+    int rest = find_delimiter_list(chars + offset, length - offset, set);
+
+    return rest < 0 ? -1 : offset + rest;
+}
+
+/* the terminator is searched with aligned loads, which cannot cross
+ * into an unmapped page but do read around the string, hence no
+ * address sanitizing; the main loop checks 64 aligned bytes at once
+ * through their minimum and leaves the exact spot to the 16 byte loop */
+__attribute__((target("sse2"), no_sanitize_address))
+static int count_chars_sse2(const char *chars)
+{
+    const char *aligned = (const char *)((uintptr_t)chars & ~(uintptr_t)15);
+    __m128i zero = _mm_setzero_si128();
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)aligned), zero)) >> (chars - aligned);
+
+    if(mask) return __builtin_ctz(mask);
+
+    aligned += 16;
+
+    while((uintptr_t)aligned & 63)
+    {
+        mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)aligned), zero));
+
+        if(mask) return (int)(aligned - chars) + __builtin_ctz(mask);
+
+        aligned += 16;
+    }
+
+    for(;;)
+    {
+        __m128i low = _mm_min_epu8(_mm_load_si128((const __m128i *)aligned), _mm_load_si128((const __m128i *)(aligned + 16)));
+        __m128i high = _mm_min_epu8(_mm_load_si128((const __m128i *)(aligned + 32)), _mm_load_si128((const __m128i *)(aligned + 48)));
+
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(low, high), zero))) break;
+
+        aligned += 64;
+    }
+
+    for(;;)
+    {
+        mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)aligned), zero));
+
+        if(mask) return (int)(aligned - chars) + __builtin_ctz(mask);
+
+        aligned += 16;
+    }
+}
+
+/* characters are signed here, so bytes above 127 never fall in range */
+__attribute__((target("sse2")))
+static void change_case_sse2(char *chars, int length, char first, char last)
+{
+    __m128i below = _mm_set1_epi8((char)(first - 1)), above = _mm_set1_epi8((char)(last + 1)), flip = _mm_set1_epi8(32);
+    int offset = 0;
+
+    while(length - offset >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(chars + offset));
+        __m128i in_range = _mm_and_si128(_mm_cmpgt_epi8(chunk, below), _mm_cmpgt_epi8(above, chunk));
+
+        _mm_storeu_si128((__m128i *)(chars + offset), _mm_xor_si128(chunk, _mm_and_si128(in_range, flip)));
+
+        offset += 16;
+    }
+
+    change_case_bytes(chars + offset, length - offset, first, last);
+}
+
+/* equal bytes compare to -1, so subtracting the comparisons counts
+ * matches per byte lane; the lanes are summed before they can wrap */
+__attribute__((target("sse2")))
+static int count_mismatches_sse2(const char *a, const char *b, int length)
+{
+    int offset = 0, matches = 0;
+
+    while(length - offset >= 16)
+    {
+        __m128i counts = _mm_setzero_si128();
+        int i;
+
+        for(i = 0; i < 255 && length - offset >= 16; i++, offset += 16)
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + offset)), _mm_loadu_si128((const __m128i *)(b + offset))));
+
+        counts = _mm_sad_epu8(counts, _mm_setzero_si128());
+        matches += _mm_cvtsi128_si32(counts) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(counts, counts));
+    }
+
+    return offset - matches + count_mismatches_bytes(a + offset, b + offset, length - offset);
+}
+
+/* 16 positions are checked at once for the first character of the
+ * needle and, as far along as the needle is long, for its last one;
+ * only positions with both are compared in full. The loads stay within
+ * the last full block of positions, the rest go to the byte loop */
+__attribute__((target("sse2")))
+static int find_needle_sse2(const char *chars, int length, const char *needle, int needle_length)
+{
+    __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[needle_length - 1]);
+    int offset = 0;
+
+    while(length - needle_length - offset >= 15)
+    {
+        __m128i hits = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(chars + offset)), first),
+                                     _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(chars + offset + needle_length - 1)), last));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+
+        while(mask)
+        {
+            int i = offset + __builtin_ctz(mask);
+
+            if(needle_at(chars + i, needle, needle_length)) return i;
+
+            mask &= mask - 1;
+        }
+
+        offset += 16;
+    }
+
+    int rest = find_needle_bytes(chars + offset, length - offset, needle, needle_length);
+
+    return rest < 0 ? -1 : offset + rest;
+}
+
+/* walks the blocks of positions from the end, leaving
+ * the ones before the first full block to the byte loop */
+__attribute__((target("sse2")))
+static int rfind_needle_sse2(const char *chars, int length, const char *needle, int needle_length)
+{
+    __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[needle_length - 1]);
+    int offset = length - needle_length - 15;
+
+    while(offset >= 0)
+    {
+        __m128i hits = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(chars + offset)), first),
+                                     _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(chars + offset + needle_length - 1)), last));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+
+        while(mask)
+        {
+            int bit = 31 - __builtin_clz(mask);
+
+            if(needle_at(chars + offset + bit, needle, needle_length)) return offset + bit;
+
+            mask &= ~(1u << bit);
+        }
+
+        offset -= 16;
+    }
+
+    return rfind_needle_bytes(chars, offset + 15 + needle_length, needle, needle_length);
+}
+
+__attribute__((target("avx2")))
+static int find_delimiter_avx2(const char *chars, int length, const struct delimiter_set *set)
+{
+    __m256i delimiters[16];
+    int i, offset = 0;
+
+    for(i = 0; i < set->count; i++) delimiters[i] = _mm256_set1_epi8((char)set->chars[i]);
+
+    while(length - offset >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(chars + offset));
+        __m256i hits = _mm256_cmpeq_epi8(chunk, delimiters[0]);
+
+        for(i = 1; i < set->count; i++) hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, delimiters[i]));
+
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+
+        if(mask) return offset + __builtin_ctz(mask);
+
+        offset += 32;
+    }
+
+    int rest = find_delimiter_list(chars + offset, length - offset, set);
+
+    return rest < 0 ? -1 : offset + rest;
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+static int count_chars_avx2(const char *chars)
+{
+    const char *aligned = (const char *)((uintptr_t)chars & ~(uintptr_t)31);
+    __m256i zero = _mm256_setzero_si256();
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)aligned), zero)) >> (chars - aligned);
+
+    if(mask) return __builtin_ctz(mask);
+
+    aligned += 32;
+
+    while((uintptr_t)aligned & 127)
+    {
+        mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)aligned), zero));
+
+        if(mask) return (int)(aligned - chars) + __builtin_ctz(mask);
+
+        aligned += 32;
+    }
+
+    for(;;)
+    {
+        __m256i low = _mm256_min_epu8(_mm256_load_si256((const __m256i *)aligned), _mm256_load_si256((const __m256i *)(aligned + 32)));
+        __m256i high = _mm256_min_epu8(_mm256_load_si256((const __m256i *)(aligned + 64)), _mm256_load_si256((const __m256i *)(aligned + 96)));
+
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(low, high), zero))) break;
+
+        aligned += 128;
+    }
+
+    for(;;)
+    {
+        mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)aligned), zero));
+
+        if(mask) return (int)(aligned - chars) + __builtin_ctz(mask);
+
+        aligned += 32;
+    }
+}
+
+__attribute__((target("avx2")))
+static void change_case_avx2(char *chars, int length, char first, char last)
+{
+    __m256i below = _mm256_set1_epi8((char)(first - 1)), above = _mm256_set1_epi8((char)(last + 1)), flip = _mm256_set1_epi8(32);
+    int offset = 0;
+
+    while(length - offset >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(chars + offset));
+        __m256i in_range = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, below), _mm256_cmpgt_epi8(above, chunk));
+
+        _mm256_storeu_si256((__m256i *)(chars + offset), _mm256_xor_si256(chunk, _mm256_and_si256(in_range, flip)));
+
+        offset += 32;
+    }
+
+    change_case_bytes(chars + offset, length - offset, first, last);
+}
+
+__attribute__((target("avx2")))
+static int count_mismatches_avx2(const char *a, const char *b, int length)
+{
+    int offset = 0, matches = 0;
+
+    while(length - offset >= 32)
+    {
+        __m256i counts = _mm256_setzero_si256();
+        int i;
+
+        for(i = 0; i < 255 && length - offset >= 32; i++, offset += 32)
+            counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + offset)), _mm256_loadu_si256((const __m256i *)(b + offset))));
+
+        counts = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+
+        __m128i sums = _mm_add_epi64(_mm256_castsi256_si128(counts), _mm256_extracti128_si256(counts, 1));
+
+        matches += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums));
+    }
+
+    return offset - matches + count_mismatches_bytes(a + offset, b + offset, length - offset);
+}
+
+__attribute__((target("avx2")))
+static int find_needle_avx2(const char *chars, int length, const char *needle, int needle_length)
+{
+    __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[needle_length - 1]);
+    int offset = 0;
+
+    while(length - needle_length - offset >= 31)
+    {
+        __m256i hits = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(chars + offset)), first),
+                                        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(chars + offset + needle_length - 1)), last));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+
+        while(mask)
+        {
+            int i = offset + __builtin_ctz(mask);
+
+            if(needle_at(chars + i, needle, needle_length)) return i;
+
+            mask &= mask - 1;
+        }
+
+        offset += 32;
+    }
+
+    int rest = find_needle_bytes(chars + offset, length - offset, needle, needle_length);
+
+    return rest < 0 ? -1 : offset + rest;
+}
+
+__attribute__((target("avx2")))
+static int rfind_needle_avx2(const char *chars, int length, const char *needle, int needle_length)
+{
+    __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[needle_length - 1]);
+    int offset = length - needle_length - 31;
+
+    while(offset >= 0)
+    {
+        __m256i hits = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(chars + offset)), first),
+                                        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(chars + offset + needle_length - 1)), last));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+
+        while(mask)
+        {
+            int bit = 31 - __builtin_clz(mask);
+
+            if(needle_at(chars + offset + bit, needle, needle_length)) return offset + bit;
+
+            mask &= ~(1u << bit);
+        }
+
+        offset -= 32;
+    }
+
+    return rfind_needle_bytes(chars, offset + 31 + needle_length, needle, needle_length);
+}
+
+#endif
+
+/* the first caller picks the kernels, any other waits until it is done */
+static void select_string_kernels(void)
+{
+    int spins = 0;
+
+#if defined(_MSC_VER)
+    if(_InterlockedCompareExchange(&KERNELS_READY, 1, 0) != 0)
+    {
+        while(KERNELS_READY != 2) pool_backoff(&spins);
+        return;
+    }
+#else
+    long expected = 0;
+
+    if(!__atomic_compare_exchange_n(&KERNELS_READY, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+        while(__atomic_load_n(&KERNELS_READY, __ATOMIC_ACQUIRE) != 2) pool_backoff(&spins);
+        return;
+    }
+#endif
+
+    FIND_DELIMITER = find_delimiter_list;
+    COUNT_CHARS = count_chars_bytes;
+    CHANGE_CASE = change_case_bytes;
+    COUNT_MISMATCHES = count_mismatches_bytes;
+    FIND_NEEDLE = find_needle_bytes;
+    RFIND_NEEDLE = rfind_needle_bytes;
+
+#ifdef STRING_X86
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2"))
+    {
+        FIND_DELIMITER = find_delimiter_avx2;
+        COUNT_CHARS = count_chars_avx2;
+        CHANGE_CASE = change_case_avx2;
+        COUNT_MISMATCHES = count_mismatches_avx2;
+        FIND_NEEDLE = find_needle_avx2;
+        RFIND_NEEDLE = rfind_needle_avx2;
+    }
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        FIND_DELIMITER = find_delimiter_sse2;
+        COUNT_CHARS = count_chars_sse2;
+        CHANGE_CASE = change_case_sse2;
+        COUNT_MISMATCHES = count_mismatches_sse2;
+        FIND_NEEDLE = find_needle_sse2;
+        RFIND_NEEDLE = rfind_needle_sse2;
+    }
+#endif
+
+#if defined(_MSC_VER)
+    _InterlockedExchange(&KERNELS_READY, 2);
+#else
+    __atomic_store_n(&KERNELS_READY, 2, __ATOMIC_RELEASE);
+#endif
+}
+
+static int find_delimiter(const char *chars, int length, const struct delimiter_set *set)
+{
+    if(set->count == 0) return -1;
+    if(set->count > 16) return find_delimiter_table(chars, length, set);
+    if(LOAD_ACQUIRE(&KERNELS_READY) != 2) select_string_kernels();
+
+    return FIND_DELIMITER(chars, length, set);
+}
+
+static struct string_split *split_string(string_t str, string_t format)
+{
+    if(str == NULL || format == NULL) return NULL;
+
+    struct delimiter_set set;
+    int length = count_string(str), count = 1, at = 0, found, i;
+
+    make_delimiter_set(&set, format);
+
+    /* one pass to size the allocation, one to fill it */
+    while((found = find_delimiter(str + at, length - at, &set)) >= 0)
+    {
+        count++;
+        at += found + 1;
+    }
+
+    struct string_split *split = (struct string_split *)malloc(sizeof(struct string_split) + 2 * sizeof(int) * (size_t)count + (size_t)length + 1);
+
+    if(split == NULL) return NULL;
+
+    split->count = count;
+    split->offsets = (int *)(split + 1);
+    split->lengths = split->offsets + count;
+    split->chars = (char *)(split->lengths + count);
+
+    copy_string(split->chars, str, length + 1);
+
+    for(i = 0, at = 0; i < count; i++)
+    {
+        found = i < count - 1 ? find_delimiter(str + at, length - at, &set) : length - at;
+
+        split->offsets[i] = at;
+        split->lengths[i] = found;
+        split->chars[at + found] = 0;
+
+        at += found + 1;
+    }
+
+    return split;
+}
+
+static int split_each(struct string_view view, string_t format, int (*callback)(struct string_view piece, void *data), void *data)
+{
+    struct delimiter_set set;
+    struct string_view piece;
+    int count = 0, found;
+
+    if(view.chars == NULL || format == NULL || callback == NULL) return 0;
+
+    make_delimiter_set(&set, format);
+
+    do
+    {
+        found = find_delimiter(view.chars, view.length, &set);
+
+        piece.chars = view.chars;
+        piece.length = found < 0 ? view.length : found;
+
+        view.chars += found + 1;
+        view.length -= found + 1;
+
+        count++;
+    }
+    while(callback(piece, data) && found >= 0);
+
+    return count;
+}
+
+static void toupper(char *str)
+{
+    if(str == NULL) return;
+
+    /* count_chars() picks the kernels, so it runs before CHANGE_CASE is read */
+    int length = count_chars(str);
+
+    CHANGE_CASE(str, length, 'a', 'z');
+}
+
+static void tolower(char *str)
+{
+    if(str == NULL) return;
+
+    int length = count_chars(str);
+
+    CHANGE_CASE(str, length, 'A', 'Z');
+}
+
+static int compare_strings(const char *a, const char *b)
+{
+    if(a == NULL || b == NULL) return -1;
+
+    int length = count_chars(a), diff = length - count_chars(b);
+
+    if(diff < 0) diff *= -1;
+    else length -= diff;
+
+    return diff + COUNT_MISMATCHES(a, b, length);
+}
+
+/* the byte at index, counted from the end when reverse is set, which
+ * lets the Two-Way search below run backwards for rfind_string() */
+#define SEARCH_BYTE(chars, length, index, reverse) ((unsigned char)(chars)[(reverse) ? (length) - 1 - (index) : (index)])
+
+/* returns the start of the maximal suffix of needle, less one, under the
+ * byte order or its inverse, and stores the period of that suffix */
+static int maximal_suffix(const char *needle, int length, int reverse, int invert, int *period)
+{
+    int suffix = -1, j = 0, k = 1, p = 1;
+
+    while(j + k < length)
+    {
+        unsigned char a = SEARCH_BYTE(needle, length, j + k, reverse), b = SEARCH_BYTE(needle, length, suffix + k, reverse);
+
+        if(invert ? a > b : a < b)
+        {
+            j += k;
+            k = 1;
+            p = j - suffix;
+        }
+        else if(a == b)
+        {
+            if(k != p) k++;
+            else
+            {
+                j += p;
+                k = 1;
+            }
+        }
+        else
+        {
+            suffix = j++;
+            k = p = 1;
+        }
+    }
+
+    *period = p;
+
+    return suffix;
+}
+
+/* Crochemore and Perrin's Two-Way algorithm: the needle is cut at its
+ * critical factorization, the right part is matched left to right and
+ * the left part right to left, and the shifts never let a haystack
+ * character be compared more than twice. Whenever the first comparison
+ * of the right part fails, the search jumps to the next spot where up
+ * to STRING_SEARCH_SHORT characters of it match, found by the short
+ * needle kernels, which keeps the worst case linear. Returns the
+ * position counted from the end when reverse is set */
+static int two_way_search(const char *chars, int length, const char *needle, int needle_length, int reverse)
+{
+    int period, other, suffix, memory = 0, i, j = 0;
+    int split = maximal_suffix(needle, needle_length, reverse, 0, &period);
+    int inverted = maximal_suffix(needle, needle_length, reverse, 1, &other);
+
+    if(inverted > split)
+    {
+        split = inverted;
+        period = other;
+    }
+
+    suffix = split + 1;
+
+    /* the needle is periodic when its left part recurs one period on */
+    for(i = 0; i < suffix && SEARCH_BYTE(needle, needle_length, i, reverse) == SEARCH_BYTE(needle, needle_length, i + period, reverse); i++);
+
+    int periodic = i == suffix;
+
+    if(!periodic) period = (suffix > needle_length - suffix ? suffix : needle_length - suffix) + 1;
+
+    while(j <= length - needle_length)
+    {
+        i = suffix > memory ? suffix : memory;
+
+        while(i < needle_length && SEARCH_BYTE(needle, needle_length, i, reverse) == SEARCH_BYTE(chars, length, i + j, reverse)) i++;
+
+        if(i < needle_length)
+        {
+            if(i == suffix && memory == 0)
+            {
+                int part = needle_length - suffix < STRING_SEARCH_SHORT ? needle_length - suffix : STRING_SEARCH_SHORT;
+                int found;
+
+                if(!reverse)
+                {
+                    found = FIND_NEEDLE(chars + j + 1 + suffix, length - needle_length - j + part - 1, needle + suffix, part);
+                    j = found < 0 ? length : j + 1 + found;
+                }
+                else
+                {
+                    found = RFIND_NEEDLE(chars + needle_length - suffix - part, length - needle_length - j + part - 1, needle + needle_length - suffix - part, part);
+                    j = found < 0 ? length : length - needle_length - found;
+                }
+            }
+            else j += i - suffix + 1;
+
+            memory = 0;
+            continue;
+        }
+
+        for(i = suffix - 1; i >= memory && SEARCH_BYTE(needle, needle_length, i, reverse) == SEARCH_BYTE(chars, length, i + j, reverse); i--);
+
+        if(i < memory) return j;
+
+        j += period;
+        memory = periodic ? needle_length - period : 0;
+    }
+
+    return -1;
+}
+
+#undef SEARCH_BYTE
+
+static int search_chars(const char *chars, int length, const char *needle, int needle_length, int reverse)
+{
+    if(needle_length == 0) return reverse ? length : 0;
+    if(needle_length > length) return -1;
+    if(LOAD_ACQUIRE(&KERNELS_READY) != 2) select_string_kernels();
+
+    if(needle_length <= STRING_SEARCH_SHORT) return (reverse ? RFIND_NEEDLE : FIND_NEEDLE)(chars, length, needle, needle_length);
+
+    int found = two_way_search(chars, length, needle, needle_length, reverse);
+
+    return found < 0 || !reverse ? found : length - needle_length - found;
+}
+
+static int find_string(string_t str, const char *needle)
+{
+    if(str == NULL || needle == NULL) return -1;
+
+    return search_chars(str, count_string(str), needle, count_chars(needle), 0);
+}
+
+static int rfind_string(string_t str, const char *needle)
+{
+    if(str == NULL || needle == NULL) return -1;
+
+    return search_chars(str, count_string(str), needle, count_chars(needle), 1);
+}
+
+static int count_occurrences(string_t str, const char *needle)
+{
+    if(str == NULL || needle == NULL) return 0;
+
+    int length = count_string(str), needle_length = count_chars(needle), at = 0, count = 0, found;
+
+    if(needle_length == 0) return 0;
+
+    while((found = search_chars(str + at, length - at, needle, needle_length, 0)) >= 0)
+    {
+        count++;
+        at += found + needle_length;
+    }
+
+    return count;
+}
+
+static int small_string(struct small_string *small, const char *chars)
+{
+    small->data.chars[0] = 0;
+    small->data.chars[SMALL_STRING_CAPACITY] = SMALL_STRING_CAPACITY;
+
+    if(chars == NULL) return 1;
+
+    return append_small_string(small, chars, count_chars(chars));
+}
+
+static char *small_string_chars(struct small_string *small)
+{
+    if(SMALL_STRING_LEFT(small) == SMALL_STRING_HEAP) return small->data.str;
+
+    return small->data.chars;
+}
+
+static int count_small_string(struct small_string *small)
+{
+    if(SMALL_STRING_LEFT(small) == SMALL_STRING_HEAP) return count_string(small->data.str);
+
+    return SMALL_STRING_CAPACITY - SMALL_STRING_LEFT(small);
+}
+
+static int append_small_string(struct small_string *small, const char *chars, int length)
+{
+    if(length < 0 || (chars == NULL && length > 0)) return 0;
+
+    if(SMALL_STRING_LEFT(small) == SMALL_STRING_HEAP)
+    {
+        string_t str = append_chars(small->data.str, chars, length);
+
+        if(str == NULL) return 0;
+
+        small->data.str = str;
+        return 1;
+    }
+
+    int count = count_small_string(small);
+
+    if(length <= SMALL_STRING_LEFT(small))
+    {
+        copy_string(small->data.chars + count, (string_t)chars, length);
+
+        small->data.chars[count + length] = 0;
+        small->data.chars[SMALL_STRING_CAPACITY] = (char)(SMALL_STRING_CAPACITY - count - length);
+
+        return 1;
+    }
+
+    /* promote to the heap; append_chars() leaves room to grow */
+    string_t str = create_string(small->data.chars, count);
+    string_t grown = str == NULL ? NULL : append_chars(str, chars, length);
+
+    if(grown == NULL)
+    {
+        free_string(str);
+        return 0;
+    }
+
+    small->data.str = grown;
+    small->data.chars[SMALL_STRING_CAPACITY] = (char)SMALL_STRING_HEAP;
+
+    return 1;
+}
+
+static void free_small_string(struct small_string *small)
+{
+    if(SMALL_STRING_LEFT(small) == SMALL_STRING_HEAP) free_string(small->data.str);
+
+    small_string(small, NULL);
+}
+
+static struct string_view view_string(string_t str)
+{
+    struct string_view view = { str, str == NULL ? 0 : count_string(str) };
+
+    return view;
+}
+
+static struct string_view view_chars(const char *chars, int length)
+{
+    struct string_view view = { chars, 0 };
+
+    if(chars != NULL) view.length = length < 0 ? count_chars(chars) : length;
+
+    return view;
+}
+
+static struct string_view view_small_string(struct small_string *small)
+{
+    struct string_view view = { small_string_chars(small), count_small_string(small) };
+
+    return view;
+}
+
+static struct string_view substring_view(struct string_view view, int start, int end)
+{
+    struct string_view sub = { NULL, 0 };
+
+    if(view.chars == NULL || start < 0 || end < start || end > view.length) return sub;
+
+    sub.chars = view.chars + start;
+    sub.length = end - start;
+
+    return sub;
+}
+
+static int slice_view(struct string_view view, int index, struct string_view *halves)
+{
+    if(view.chars == NULL || index < 0 || index >= view.length) return 0;
+
+    /* the character at index belongs to neither half */
+    halves[0] = substring_view(view, 0, index);
+    halves[1] = substring_view(view, index + 1, view.length);
+
+    return 1;
+}
+
+static int split_view(struct string_view *rest, string_t format, struct string_view *piece)
+{
+    if(rest->chars == NULL || format == NULL) return 0;
+
+    struct delimiter_set set;
+
+    make_delimiter_set(&set, format);
+
+    int found = find_delimiter(rest->chars, rest->length, &set);
+
+    *piece = *rest;
+
+    if(found >= 0)
+    {
+        piece->length = found;
+
+        rest->chars += found + 1;
+        rest->length -= found + 1;
+
+        return 1;
+    }
+
+    /* the last piece; the next call finds nothing left */
+    rest->chars = NULL;
+    rest->length = 0;
+
+    return 1;
+}
+
+static struct string_view trim_view(struct string_view view)
+{
+    if(view.chars == NULL) return view;
+
+    while(view.length > 0 && (view.chars[0] == ' ' || (view.chars[0] >= 9 && view.chars[0] <= 13)))
+    {
+        view.chars++;
+        view.length--;
+    }
+
+    while(view.length > 0 && (view.chars[view.length - 1] == ' ' || (view.chars[view.length - 1] >= 9 && view.chars[view.length - 1] <= 13)))
+        view.length--;
+
+    return view;
+}
+
+static int find_view(struct string_view view, struct string_view needle)
+{
+    if(view.chars == NULL || needle.chars == NULL) return -1;
+
+    return search_chars(view.chars, view.length, needle.chars, needle.length, 0);
+}
+
+static string_t view_to_string(struct string_view view)
+{
+    if(view.chars == NULL) return NULL;
+
+    return create_string(view.chars, view.length);
+}
+
+static void string_builder(struct string_builder *builder)
+{
+    builder->first = builder->last = NULL;
+    builder->length = 0;
+}
+
+static int append_builder(struct string_builder *builder, const char *chars, int length)
+{
+    if(length < 0 || length > 0x7fffffff - builder->length) return 0;
+
+    struct builder_chunk *chunk = builder->last;
+
+    /* fill up the last chunk first, then add one as big as everything so
+     * far, up to STRING_BUILDER_CHUNK, so the chunk count stays small */
+    if(chunk != NULL)
+    {
+        int room = chunk->capacity - chunk->used;
+        int part = length < room ? length : room;
+
+        copy_string((char *)(chunk + 1) + chunk->used, (string_t)chars, part);
+
+        chunk->used += part;
+        builder->length += part;
+        chars += part;
+        length -= part;
+    }
+
+    if(length == 0) return 1;
+
+    int capacity = builder->length < STRING_BUILDER_CHUNK ? builder->length : STRING_BUILDER_CHUNK;
+
+    if(capacity < length) capacity = length;
+    if(capacity < 256) capacity = 256;
+
+    chunk = (struct builder_chunk *)malloc(sizeof(struct builder_chunk) + capacity);
+
+    if(chunk == NULL) return 0;
+
+    chunk->next = NULL;
+    chunk->used = length;
+    chunk->capacity = capacity;
+
+    copy_string((char *)(chunk + 1), (string_t)chars, length);
+
+    if(builder->last != NULL) builder->last->next = chunk;
+    else builder->first = chunk;
+
+    builder->last = chunk;
+    builder->length += length;
+
+    return 1;
+}
+
+static string_t flatten_builder(struct string_builder *builder)
+{
+    string_t str = create_string(NULL, builder->length);
+    struct builder_chunk *chunk;
+    int at = 0;
+
+    if(str == NULL) return NULL;
+
+    for(chunk = builder->first; chunk != NULL; chunk = chunk->next)
+    {
+        copy_string(str + at, (char *)(chunk + 1), chunk->used);
+        at += chunk->used;
+    }
+
+    return str;
+}
+
+static void free_builder(struct string_builder *builder)
+{
+    while(builder->first != NULL)
+    {
+        struct builder_chunk *chunk = builder->first;
+
+        builder->first = chunk->next;
+        free(chunk);
+    }
+
+    string_builder(builder);
+}
+
+/* nodes come from the allocator at regular strides, so the address goes
+ * through the full 64-bit finalizer of MurmurHash3; a single multiply
+ * leaves the priorities correlated and the treap deep */
+static unsigned int rope_priority(struct rope_node *node)
+{
+    unsigned long long x = (unsigned long long)(uintptr_t)node;
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+
+    return (unsigned int)x;
+}
+
+static int rope_length(struct rope_node *node)
+{
+    return node == NULL ? 0 : node->length;
+}
+
+static struct rope_node *rope_update(struct rope_node *node)
+{
+    node->length = rope_length(node->left) + node->size + rope_length(node->right);
+
+    return node;
+}
+
+static struct rope_node *rope_piece(const char *chars, int size, int capacity)
+{
+    struct rope_node *node = (struct rope_node *)malloc(sizeof(struct rope_node) + capacity);
+
+    if(node == NULL) return NULL;
+
+    node->left = node->right = NULL;
+    node->length = node->size = size;
+    node->capacity = capacity;
+
+    copy_string(ROPE_CHARS(node), (string_t)chars, size);
+
+    return node;
+}
+
+/* joins two treaps, with everything in a before everything in b */
+static struct rope_node *rope_merge(struct rope_node *a, struct rope_node *b)
+{
+    if(a == NULL) return b;
+    if(b == NULL) return a;
+
+    if(rope_priority(a) > rope_priority(b))
+    {
+        a->right = rope_merge(a->right, b);
+        return rope_update(a);
+    }
+
+    b->left = rope_merge(a, b->left);
+    return rope_update(b);
+}
+
+/* splits a treap into the characters before index and the rest; when
+ * index falls inside a piece, the piece is cut short and the rest of it
+ * is left to the caller */
+static void rope_split(struct rope_node *node, int index, struct rope_node **left, struct rope_node **right)
+{
+    if(node == NULL)
+    {
+        *left = *right = NULL;
+        return;
+    }
+
+    int before = rope_length(node->left);
+
+    if(index <= before)
+    {
+        rope_split(node->left, index, left, &node->left);
+        *right = rope_update(node);
+    }
+    else if(index >= before + node->size)
+    {
+        rope_split(node->right, index - before - node->size, &node->right, right);
+        *left = rope_update(node);
+    }
+    else
+    {
+        *right = node->right;
+
+        node->size = index - before;
+        node->right = NULL;
+        *left = rope_update(node);
+    }
+}
+
+/* swaps piece in for node, the last piece of tree when last is set and
+ * the first otherwise; the node's address sets its priority, so the new
+ * piece goes through a split and a merge instead of taking its place */
+static void rope_replace(struct rope_node **tree, struct rope_node *node, struct rope_node *piece, int last)
+{
+    struct rope_node *rest, *old;
+
+    if(last)
+    {
+        rope_split(*tree, rope_length(*tree) - node->size, &rest, &old);
+        *tree = rope_merge(rest, piece);
+    }
+    else
+    {
+        rope_split(*tree, node->size, &old, &rest);
+        *tree = rope_merge(piece, rest);
+    }
+
+    free(old);
+}
+
+/* puts a short insert into the piece before or after it when the two
+ * fit in a leaf, appending in place while there is room, so text typed
+ * a character at a time does not take a node per character. Returns 0
+ * when neither neighbour fits or memory runs out */
+static int rope_absorb(struct rope_node **left, struct rope_node **right, const char *chars, int length)
+{
+    struct rope_node *node, *piece;
+
+    for(node = *left; node != NULL && node->right != NULL; node = node->right);
+
+    if(node != NULL && node->size + length <= node->capacity)
+    {
+        copy_string(ROPE_CHARS(node) + node->size, (string_t)chars, length);
+        node->size += length;
+
+        for(node = *left; node != NULL; node = node->right) node->length += length;
+
+        return 1;
+    }
+
+    /* a full neighbour is copied into a new piece with twice the room,
+     * up to a leaf, so appends to it stay amortized constant */
+    if(node != NULL && node->size + length <= STRING_ROPE_LEAF)
+    {
+        int size = node->size + length;
+
+        piece = rope_piece(ROPE_CHARS(node), node->size, size * 2 < STRING_ROPE_LEAF ? size * 2 : STRING_ROPE_LEAF);
+
+        if(piece == NULL) return 0;
+
+        copy_string(ROPE_CHARS(piece) + node->size, (string_t)chars, length);
+        piece->length = piece->size = size;
+
+        rope_replace(left, node, piece, 1);
+        return 1;
+    }
+
+    for(node = *right; node != NULL && node->left != NULL; node = node->left);
+
+    if(node != NULL && node->size + length <= STRING_ROPE_LEAF)
+    {
+        int size = node->size + length;
+
+        piece = rope_piece(chars, length, size * 2 < STRING_ROPE_LEAF ? size * 2 : STRING_ROPE_LEAF);
+
+        if(piece == NULL) return 0;
+
+        copy_string(ROPE_CHARS(piece) + length, ROPE_CHARS(node), node->size);
+        piece->length = piece->size = size;
+
+        rope_replace(right, node, piece, 0);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* splits a rope at index; a piece that straddles it has its second part
+ * copied out first, so the split cannot fail halfway, and the copy goes
+ * in front of the right side afterwards. A first part left in under a
+ * quarter of its allocation is moved to a piece of its own size */
+static int rope_cut(struct string_rope *rope, int index, struct rope_node **left, struct rope_node **right)
+{
+    struct rope_node *node = rope->root, *tail = NULL, *head = NULL;
+    int at = index;
+
+    while(node != NULL)
+    {
+        int before = rope_length(node->left);
+
+        if(at <= before) node = node->left;
+        else if(at >= before + node->size)
+        {
+            at -= before + node->size;
+            node = node->right;
+        }
+        else
+        {
+            tail = rope_piece(ROPE_CHARS(node) + at - before, node->size - (at - before), node->size - (at - before));
+
+            if(tail == NULL) return 0;
+
+            /* the head is only a nicety, so failing to copy it is not an error */
+            if((at - before) * 4 < node->capacity) head = rope_piece(ROPE_CHARS(node), at - before, at - before);
+            break;
+        }
+    }
+
+    rope_split(rope->root, index, left, right);
+    *right = rope_merge(tail, *right);
+
+    if(head != NULL) rope_replace(left, node, head, 1);
+
+    return 1;
+}
+
+static void rope_copy(struct rope_node *node, char *dest)
+{
+    while(node != NULL)
+    {
+        rope_copy(node->left, dest);
+        dest += rope_length(node->left);
+
+        copy_string(dest, ROPE_CHARS(node), node->size);
+        dest += node->size;
+
+        node = node->right;
+    }
+}
+
+static void rope_free(struct rope_node *node)
+{
+    while(node != NULL)
+    {
+        struct rope_node *right = node->right;
+
+        rope_free(node->left);
+        free(node);
+
+        node = right;
+    }
+}
+
+static int string_rope(struct string_rope *rope, const char *chars, int length)
+{
+    rope->root = NULL;
+
+    if(chars == NULL) return 1;
+    if(length < 0) length = count_chars(chars);
+
+    return insert_rope(rope, 0, chars, length);
+}
+
+static int count_rope(struct string_rope *rope)
+{
+    return rope_length(rope->root);
+}
+
+static int insert_rope(struct string_rope *rope, int index, const char *chars, int length)
+{
+    struct rope_node *left, *right, *middle = NULL;
+    int at;
+
+    if(index < 0 || index > count_rope(rope) || length < 0 || length > 0x7fffffff - count_rope(rope)) return 0;
+    if(length == 0) return 1;
+
+    if(!rope_cut(rope, index, &left, &right)) return 0;
+
+    if(length < STRING_ROPE_LEAF && rope_absorb(&left, &right, chars, length))
+    {
+        rope->root = rope_merge(left, right);
+        return 1;
+    }
+
+    /* otherwise the new text goes in as pieces of up to STRING_ROPE_LEAF
+     * characters, built into a treap of their own between the halves */
+    for(at = 0; at < length; at += STRING_ROPE_LEAF)
+    {
+        int size = length - at < STRING_ROPE_LEAF ? length - at : STRING_ROPE_LEAF;
+        struct rope_node *piece = rope_piece(chars + at, size, size);
+
+        if(piece == NULL)
+        {
+            rope_free(middle);
+            rope->root = rope_merge(left, right);
+            return 0;
+        }
+
+        middle = rope_merge(middle, piece);
+    }
+
+    rope->root = rope_merge(rope_merge(left, middle), right);
+
+    return 1;
+}
+
+static int delete_rope(struct string_rope *rope, int index, int length)
+{
+    struct rope_node *left, *middle, *right;
+
+    if(index < 0 || length < 0 || length > count_rope(rope) - index) return 0;
+    if(length == 0) return 1;
+
+    if(!rope_cut(rope, index, &left, &right)) return 0;
+
+    rope->root = right;
+
+    if(!rope_cut(rope, length, &middle, &right))
+    {
+        rope->root = rope_merge(left, right);
+        return 0;
+    }
+
+    rope_free(middle);
+    rope->root = rope_merge(left, right);
+
+    return 1;
+}
+
+static string_t flatten_rope(struct string_rope *rope)
+{
+    string_t str = create_string(NULL, count_rope(rope));
+
+    if(str != NULL) rope_copy(rope->root, str);
+
+    return str;
+}
+
+static void free_rope(struct string_rope *rope)
+{
+    rope_free(rope->root);
+    rope->root = NULL;
+}
+
+/* FNV-1a */
+static unsigned int hash_chars(const char *chars, int length)
+{
+    unsigned int hash = 2166136261u;
+    int i;
+
+    for(i = 0; i < length; i++) hash = (hash ^ (unsigned char)chars[i]) * 16777619u;
+
+    return hash;
+}
+
+/* pauses while another thread holds a pool lock or picks the kernels,
+ * and yields the CPU after a while in case that thread was preempted */
+static void pool_backoff(int *spins)
+{
+    if(++*spins < STRING_POOL_SPINS)
+    {
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+        _mm_pause();
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_ia32_pause();
+#endif
+        return;
+    }
+
+    *spins = 0;
+
+#if defined(_MSC_VER)
+    SwitchToThread();
+#elif defined(unix) || defined(__unix__) || defined(__unix) || defined(__APPLE__)
+    sched_yield();
+#endif
+}
+
+static void pool_lock(struct string_pool *pool)
+{
+    if(!(pool->flags & STRING_POOL_THREADS)) return;
+
+    int spins = 0;
+
+#if defined(_MSC_VER)
+    while(_InterlockedExchange(&pool->lock, 1))
+        while(pool->lock) pool_backoff(&spins);
+#else
+    while(__atomic_exchange_n(&pool->lock, 1, __ATOMIC_ACQUIRE))
+        while(__atomic_load_n(&pool->lock, __ATOMIC_RELAXED)) pool_backoff(&spins);
+#endif
+}
+
+static void pool_unlock(struct string_pool *pool)
+{
+    if(!(pool->flags & STRING_POOL_THREADS)) return;
+
+#if defined(_MSC_VER)
+    _InterlockedExchange(&pool->lock, 0);
+#else
+    __atomic_store_n(&pool->lock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+/* allocates an entry with room for length characters, from the arena
+ * when the pool has one; strings too big for a quarter of a block get
+ * a block of their own behind the current one */
+static struct intern_entry *pool_entry(struct string_pool *pool, int length)
+{
+    int size = (int)((sizeof(struct intern_entry) + length + 1 + sizeof(void *) - 1) & ~(sizeof(void *) - 1));
+
+    if(!(pool->flags & STRING_POOL_ARENA)) return (struct intern_entry *)malloc(size);
+
+    struct builder_chunk *block = pool->blocks;
+
+    if(block == NULL || block->capacity - block->used < size)
+    {
+        int capacity = size > STRING_POOL_BLOCK / 4 ? size : STRING_POOL_BLOCK - (int)sizeof(struct builder_chunk);
+        struct builder_chunk *fresh = (struct builder_chunk *)malloc(sizeof(struct builder_chunk) + capacity);
+
+        if(fresh == NULL) return NULL;
+
+        fresh->used = 0;
+        fresh->capacity = capacity;
+
+        if(block != NULL && capacity == size)
+        {
+            fresh->next = block->next;
+            block->next = fresh;
+        }
+        else
+        {
+            fresh->next = block;
+            pool->blocks = fresh;
+        }
+
+        block = fresh;
+    }
+
+    struct intern_entry *entry = (struct intern_entry *)((char *)(block + 1) + block->used);
+
+    block->used += size;
+
+    return entry;
+}
+
+/* doubles the bucket count once the pool holds as many strings */
+static int grow_pool(struct string_pool *pool)
+{
+    int count = pool->bucket_count * 2, i;
+    struct intern_entry **buckets = (struct intern_entry **)calloc((size_t)count, sizeof(struct intern_entry *));
+
+    if(buckets == NULL) return 0;
+
+    for(i = 0; i < pool->bucket_count; i++)
+    {
+        while(pool->buckets[i] != NULL)
+        {
+            struct intern_entry *entry = pool->buckets[i];
+
+            pool->buckets[i] = entry->next;
+
+            entry->next = buckets[entry->hash & (count - 1)];
+            buckets[entry->hash & (count - 1)] = entry;
+        }
+    }
+
+    free(pool->buckets);
+
+    pool->buckets = buckets;
+    pool->bucket_count = count;
+
+    return 1;
+}
+
+static int string_pool(struct string_pool *pool, int flags)
+{
+    pool->bucket_count = 64;
+    pool->count = 0;
+    pool->flags = flags;
+    pool->blocks = NULL;
+    pool->lock = 0;
+    pool->buckets = (struct intern_entry **)calloc((size_t)pool->bucket_count, sizeof(struct intern_entry *));
+
+    return pool->buckets != NULL;
+}
+
+static string_t intern_string(struct string_pool *pool, const char *chars, int length)
+{
+    if(chars == NULL) return NULL;
+    if(length < 0) length = count_chars(chars);
+    if(length > 0x7fffffff - 64) return NULL;
+    if(LOAD_ACQUIRE(&KERNELS_READY) != 2) select_string_kernels();
+
+    unsigned int hash = hash_chars(chars, length);
+    struct intern_entry *entry;
+    string_t str = NULL;
+
+    pool_lock(pool);
+
+    for(entry = pool->buckets[hash & (pool->bucket_count - 1)]; entry != NULL; entry = entry->next)
+    {
+        if(entry->hash == hash && entry->header.length == length && COUNT_MISMATCHES(INTERN_CHARS(entry), chars, length) == 0)
+        {
+            str = INTERN_CHARS(entry);
+            break;
+        }
+    }
+
+    if(str == NULL && (pool->count < pool->bucket_count || grow_pool(pool)) && (entry = pool_entry(pool, length)) != NULL)
+    {
+        entry->hash = hash;
+        entry->header.length = entry->header.capacity = length;
+
+        str = INTERN_CHARS(entry);
+
+        copy_string(str, (string_t)chars, length);
+        str[length] = 0;
+
+        entry->next = pool->buckets[hash & (pool->bucket_count - 1)];
+        pool->buckets[hash & (pool->bucket_count - 1)] = entry;
+        pool->count++;
+    }
+
+    pool_unlock(pool);
+
+    return str;
+}
+
+static void free_pool(struct string_pool *pool)
+{
+    int i;
+
+    if(pool->flags & STRING_POOL_ARENA)
+    {
+        while(pool->blocks != NULL)
+        {
+            struct builder_chunk *block = pool->blocks;
+
+            pool->blocks = block->next;
+            free(block);
+        }
+    }
+    else
+    {
+        for(i = 0; i < pool->bucket_count; i++)
+        {
+            while(pool->buckets[i] != NULL)
+            {
+                struct intern_entry *entry = pool->buckets[i];
+
+                pool->buckets[i] = entry->next;
+                free(entry);
+            }
+        }
+    }
+
+    free(pool->buckets);
+
+    pool->buckets = NULL;
+    pool->bucket_count = pool->count = 0;
 }
 
 #endif